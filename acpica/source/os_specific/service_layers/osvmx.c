@@ -1,4 +1,8 @@
 #include <acpi.h>
+#include <semaphore.h>
+#include <thread.h>
+#include <alloc.h>
+#include <time.h>
 
 ACPI_STATUS AcpiOsInitialize(void)
 {
@@ -104,9 +108,11 @@ void AcpiOsFree(void *addr)
 	(void) addr;
 }
 
+/* ACPICA tracks mutex owners by thread id, so it has to be unique once
+ * methods run concurrently, and it must not be 0 */
 ACPI_THREAD_ID AcpiOsGetThreadId(void)
 {
-	return 1;
+	return (ACPI_THREAD_ID)(uintptr_t)thread_current();
 }
 
 ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE type, ACPI_OSD_EXEC_CALLBACK fptr,
@@ -121,7 +127,7 @@ ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE type, ACPI_OSD_EXEC_CALLBACK fptr,
 
 void AcpiOsSleep(UINT64 ms)
 {
-	/* TODO: implement */
+	time_sleep((ms + TIMER_TICK - 1) / TIMER_TICK);
 }
 
 void AcpiOsStall(UINT32 us)
@@ -134,36 +140,54 @@ void AcpiOsWaitEventsComplete(void)
 	/* TODO: implement */
 }
 
+/* max is only a sanity check, ACPICA never signals above it */
 ACPI_STATUS AcpiOsCreateSemaphore(UINT32 max, UINT32 init, ACPI_SEMAPHORE *sem)
 {
-	/* TODO: implement */
 	(void) max;
-	(void) init;
-	(void) sem;
-	return AE_NO_MEMORY;
+
+	if (!sem)
+		return AE_BAD_PARAMETER;
+
+	struct semaphore *s = mem_alloc(sizeof(*s));
+
+	if (!s)
+		return AE_NO_MEMORY;
+
+	semaphore_init(s, init);
+	*sem = s;
+	return AE_OK;
 }
 
 ACPI_STATUS AcpiOsDeleteSemaphore(ACPI_SEMAPHORE sem)
 {
-	/* TODO: implement */
-	(void) sem;
+	if (!sem)
+		return AE_BAD_PARAMETER;
+
+	mem_free(sem);
 	return AE_OK;
 }
 
 ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE sem, UINT32 acquire, UINT16 ms)
 {
-	/* TODO: implement */
-	(void) sem;
-	(void) acquire;
-	(void) ms;
+	unsigned long long ticks = SEMAPHORE_FOREVER;
+
+	if (!sem)
+		return AE_BAD_PARAMETER;
+
+	if (ms != ACPI_WAIT_FOREVER)
+		ticks = (ms + TIMER_TICK - 1) / TIMER_TICK;
+
+	if (semaphore_down_timeout(sem, acquire, ticks))
+		return AE_TIME;
 	return AE_OK;
 }
 
 ACPI_STATUS AcpiOsSignalSemaphore(ACPI_SEMAPHORE sem, UINT32 release)
 {
-	/* TODO: implement */
-	(void) sem;
-	(void) release;
+	if (!sem)
+		return AE_BAD_PARAMETER;
+
+	semaphore_up(sem, release);
 	return AE_OK;
 }
 
@@ -4,24 +4,54 @@
 #include <stddef.h>
 #include <spinlock.h>
 #include <memory.h>
+#include <numa.h>
 #include <list.h>
+#include <cpu.h>
+
+struct mem_magazine;
+
+struct mem_cache_cpu {
+	struct mem_magazine *loaded;
+	struct mem_magazine *prev;
+};
 
 struct mem_cache {
+	struct list_head ll;
 	struct spinlock lock;
-	struct list_head free_pools;
-	struct list_head partial_pools;
+	struct list_head free_pools[MAX_NODES];
+	struct list_head partial_pools[MAX_NODES];
 	struct list_head busy_pools;
 
+	/* magazine depot, protected by lock */
+	struct list_head full_magazines;
+	struct list_head empty_magazines;
+	struct mem_cache_cpu cpu[MAX_CPU_NR];
+	int magazines;
+
+	/* number of free pools and how many of them reclaim leaves */
+	size_t free_count;
+	size_t reserve;
+
 	/* struct alloc_pool layout */
 	size_t meta_offs;
 	size_t obj_count;
 	size_t mask_words;
+	size_t summary_words;
 	size_t obj_size;
 	int pool_order;
 };
 
+struct mem_reclaim_stats {
+	unsigned long shrink_calls;
+	unsigned long shrink_pages;
+	unsigned long reclaim_runs;
+	unsigned long reclaim_pages;
+};
+
 void mem_cache_setup(struct mem_cache *cache, size_t size, size_t align);
+void mem_cache_set_reserve(struct mem_cache *cache, size_t pools);
 void mem_cache_release(struct mem_cache *cache);
+unsigned long mem_cache_shrink(struct mem_cache *cache, size_t keep);
 
 void *mem_cache_alloc(struct mem_cache *cache, unsigned long flags);
 void mem_cache_free(struct mem_cache *cache, void *ptr);
@@ -30,5 +60,11 @@ void mem_alloc_setup(void);
 void *mem_alloc(size_t size);
 void *mem_realloc(void *ptr, size_t size);
 void mem_free(void *ptr);
+void mem_alloc_dump(void);
+void mem_frag_account(const void *site, size_t requested, size_t reserved);
+void mem_frag_dump(void);
+
+void mem_reclaim_setup(void);
+void mem_reclaim_stats(struct mem_reclaim_stats *stats);
 
 #endif /*__ALLOC_H__*/
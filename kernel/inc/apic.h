@@ -20,6 +20,7 @@
 #define APIC_TIMER_MODE(x)	(((x) & 3) << 17)
 #define APIC_TIMER_ONE_SHOT	APIC_TIMER_MODE(0)
 #define APIC_TIMER_PERIODIC	APIC_TIMER_MODE(1)
+#define APIC_TIMER_TSC_DEADLINE	APIC_TIMER_MODE(2)
 
 #define APIC_SPURIOUS		(0xf0)
 #define APIC_ENABLE		(1ul << 8)
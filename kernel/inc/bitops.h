@@ -0,0 +1,22 @@
+#ifndef __BITOPS_H__
+#define __BITOPS_H__
+
+/* Index of the least significant set bit, x must not be zero. */
+static inline int bsf(unsigned long long x)
+{
+	unsigned long long pos;
+
+	__asm__ ("bsfq %1, %0" : "=r"(pos) : "rm"(x) : "cc");
+	return pos;
+}
+
+/* Index of the most significant set bit, x must not be zero. */
+static inline int bsr(unsigned long long x)
+{
+	unsigned long long pos;
+
+	__asm__ ("bsrq %1, %0" : "=r"(pos) : "rm"(x) : "cc");
+	return pos;
+}
+
+#endif /*__BITOPS_H__*/
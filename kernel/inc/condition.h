@@ -1,10 +1,10 @@
 #ifndef __CONDITION_H__
 #define __CONDITION_H__
 
-#include <list.h>
+#include <wait.h>
 
 struct condition {
-	struct list_head wait_list;
+	struct wait_queue wait;
 };
 
 struct mutex;
@@ -53,6 +53,26 @@ static inline void write_msr(unsigned long msr, unsigned long long val)
 	__asm__ volatile ("wrmsr" : : "a"(low), "d"(high), "c"(msr));
 }
 
+static inline unsigned long long rdtsc(void)
+{
+	unsigned long low, high;
+
+	__asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((unsigned long long)(high & 0xfffffffful) << 32)
+			| ((unsigned long long)low & 0xfffffffful);
+}
+
+/* sti takes effect after the next instruction, so an interrupt can't
+ * sneak in between sti and hlt/mwait and be missed */
+static inline void cpu_halt(void)
+{ __asm__ volatile ("sti ; hlt" : : : "memory"); }
+
+static inline void cpu_monitor(const volatile void *addr)
+{ __asm__ volatile ("monitor" : : "a"(addr), "c"(0ul), "d"(0ul)); }
+
+static inline void cpu_mwait(void)
+{ __asm__ volatile ("sti ; mwait" : : "a"(0ul), "c"(0ul) : "memory"); }
+
 static inline unsigned long long read_cr0(void)
 {
 	unsigned long long cr0;
@@ -66,6 +86,14 @@ static inline void write_cr0(unsigned long long cr0)
 	__asm__ volatile ("movq %0, %%cr0" : : "ad"(cr0));
 }
 
+static inline unsigned long long read_cr2(void)
+{
+	unsigned long long cr2;
+
+	__asm__ volatile ("movq %%cr2, %0" : "=a"(cr2));
+	return cr2;
+}
+
 static inline unsigned long long read_cr3(void)
 {
 	unsigned long long cr3;
@@ -134,6 +162,7 @@ static inline unsigned long rflags(void)
 	return flags;
 }
 
+void cpu_early_setup(void);
 void cpu_setup(void);
 int cpu_id(void);
 int cpu_count(void);
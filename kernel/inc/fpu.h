@@ -1,7 +1,25 @@
 #ifndef __FPU_H__
 #define __FPU_H__
 
+#define FPU_NM_EXCEPTION	7
+
+/* Eager mode restores fpu state of the next thread on every switch, lazy
+ * mode leaves fpu disabled until the thread uses it. Default is eager,
+ * build with FPU_LAZY=1 to boot in lazy mode. */
+enum fpu_mode {
+	FPU_MODE_EAGER,
+	FPU_MODE_LAZY,
+};
+
+void fpu_set_mode(enum fpu_mode mode);
+enum fpu_mode fpu_get_mode(void);
+const char *fpu_save_name(void);
+
 int fpu_state_size(void);
+void *fpu_state_alloc(void);
+void fpu_state_free(void *state);
+void fpu_enable(void);
+void fpu_disable(void);
 void fpu_state_save(void *state);
 void fpu_state_restore(const void *state);
 void fpu_state_setup(void *state);
@@ -2,6 +2,7 @@
 #define __HASHTABLE_H__
 
 #include <stdatomic.h>
+#include <spinlock.h>
 #include <stdint.h>
 #include <list.h>
 
@@ -12,8 +13,11 @@ struct hash_node {
 	uint64_t key;
 };
 
+/* Buckets have their own locks, but all of them share the reader
+ * counters, so lookups never write to a shared cache line. */
 struct hash_table_impl;
 struct hash_table {
+	struct brlock_readers readers;
 	struct hash_table_impl * _Atomic table;
 	atomic_size_t entries;
 	atomic_flag resizing;
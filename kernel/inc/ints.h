@@ -9,13 +9,22 @@
 #define INT_EDGE	0
 #define INT_LEVEL	1
 
-#define IDT_SIZE	34
+#define IDT_SIZE	35
 #define IDT_EXC_BEGIN	0
 #define IDT_EXC_END	32
 #define IDT_IRQ_BEGIN	32
 #define IDT_IRQ_END	IDT_SIZE
 #define IRQ_VECTOR(x)	((x) + IDT_IRQ_BEGIN)
 
+#define INT_DOUBLE_FAULT	8
+#define INT_PAGE_FAULT		14
+
+/* Page faults run on a separate per cpu stack, so a stack overflow can
+ * still be reported. Double faults get a stack of their own, so a #DF
+ * raised while the #PF handler runs doesn't overwrite its frame. */
+#define INT_EXCEPTION_IST	1
+#define INT_DOUBLE_FAULT_IST	2
+
 struct frame {
 	uint64_t rbp;
 	uint64_t rbx;
@@ -4,6 +4,7 @@
 #include <spinlock.h>
 #include <stdint.h>
 #include <list.h>
+#include <cpu.h>
 
 #define PAGE_SHIFT	12
 #define PAGE_SIZE	(1 << PAGE_SHIFT)
@@ -26,6 +27,9 @@
 
 #define KERNEL_CS	0x08
 
+/* pages of order below PAGE_CACHE_ORDERS go through per cpu caches */
+#define PAGE_CACHE_ORDERS	4
+
 struct mem_cache;
 
 struct page {
@@ -33,24 +37,52 @@ struct page {
 	unsigned long flags;
 	union {
 		struct mem_cache *cache;
-		int order;
+		size_t pages;
 	} u;
 };
 
+/* lock is taken by the owning cpu with interrupts disabled and by
+ * page_cache_drain from any cpu */
+struct page_cache {
+	struct spinlock lock;
+	struct list_head pages[PAGE_CACHE_ORDERS];
+	int count[PAGE_CACHE_ORDERS];
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct page_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long pages;
+};
+
 struct page_alloc_zone {
 	struct spinlock lock;
 	struct list_head ll;
 	uintptr_t begin;
 	uintptr_t end;
 	unsigned long flags;
+	int id;
+	int node;
 	struct list_head order[MAX_ORDER + 1];
+	unsigned long blocks[MAX_ORDER + 1];
+	struct page_cache cache[MAX_CPU_NR];
 	struct page pages[1];
 };
 
+/* shrink callback returns the number of pages given back to the page
+ * allocator, it's called with interrupts disabled and must not allocate */
+struct shrinker {
+	struct list_head ll;
+	unsigned long (*shrink)(struct shrinker *shrinker, unsigned long pages);
+};
+
 extern struct list_head page_alloc_zones;
 
 uintptr_t page_addr(const struct page *page);
 struct page *addr_page(uintptr_t addr);
+int page_node(const struct page *page);
 
 void page_set_bit(struct page *page, int bit);
 void page_clear_bit(struct page *page, int bit);
@@ -59,8 +91,24 @@ int page_test_bit(const struct page *page, int bit);
 void page_alloc_setup(void);
 struct page *__page_alloc(int order, unsigned long flags);
 uintptr_t page_alloc(int order, unsigned long flags);
+struct page *__page_alloc_node(int order, unsigned long flags, int node);
+uintptr_t page_alloc_node(int order, unsigned long flags, int node);
 void __page_free(struct page *page, int order);
 void page_free(uintptr_t addr, int order);
+struct page *__page_alloc_pages(size_t pages, unsigned long flags);
+uintptr_t page_alloc_pages(size_t pages, unsigned long flags);
+void __page_free_pages(struct page *page, size_t pages);
+void page_free_pages(uintptr_t addr, size_t pages);
+int page_free_order(const struct page *page);
 uintptr_t phys_mem_limit(void);
 
+void page_cache_set_limits(int order, int low, int high, int batch);
+void page_cache_stats(int cpu, struct page_cache_stats *stats);
+void page_cache_drain(void);
+void page_cache_dump(void);
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+unsigned long shrink_memory(unsigned long pages);
+
 #endif /*__MEMORY_H__*/
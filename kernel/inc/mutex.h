@@ -1,20 +1,26 @@
 #ifndef __MUTEX_H__
 #define __MUTEX_H__
 
-#include <spinlock.h>
-#include <list.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <wait.h>
 
 
 struct thread;
 
+/* Owner word is the owning thread with the low bit set when somebody
+ * waits on the queue. */
 struct mutex {
-	struct spinlock lock;
-	struct list_head wait_list;
-	struct thread *owner;
+	atomic_uintptr_t owner;
+	struct wait_queue wait;
 };
 
 void mutex_init(struct mutex *mutex);
 void mutex_lock(struct mutex *mutex);
+int mutex_trylock(struct mutex *mutex);
 void mutex_unlock(struct mutex *mutex);
 
+/* spinning is on by default, without it contended lockers block */
+void mutex_set_spinning(int enable);
+
 #endif /*__MUTEX_H__*/
@@ -0,0 +1,28 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_NODES		8
+#define NUMA_LOCAL_DISTANCE	10
+#define NUMA_REMOTE_DISTANCE	20
+
+void numa_setup(void);
+
+int numa_nodes(void);
+int numa_node(void);
+int cpu_node(int cpu);
+int numa_distance(int from, int to);
+
+/* all nodes sorted by distance from node, node itself goes first */
+const int *numa_node_order(int node);
+
+/* node of phys address addr, *end is set to the end of the range that
+ * belongs to the same node */
+int numa_addr_node(uintptr_t addr, uintptr_t *end);
+
+/* bootstrap allocation that prefers memory of the node */
+uintptr_t numa_balloc_alloc(size_t size, uintptr_t align, int node);
+
+#endif /*__NUMA_H__*/
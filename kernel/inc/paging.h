@@ -32,6 +32,8 @@ struct page_table {
 	pte_t *pml4;
 };
 
+extern struct page_table kernel_pt;
+
 int pt_setup(struct page_table *pt);
 void pt_release(struct page_table *pt);
 int pt_map(struct page_table *pt, uintptr_t begin, uintptr_t end,
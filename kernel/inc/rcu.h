@@ -10,6 +10,9 @@ struct rcu_callback {
 
 void rcu_tick(void);
 void rcu_report_qs(void);
+int rcu_pending(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
 
 void rcu_read_lock(void);
 void rcu_read_unlock(void);
@@ -0,0 +1,23 @@
+#ifndef __RWSEM_H__
+#define __RWSEM_H__
+
+#include <wait.h>
+
+
+/* Sleeping reader-writer semaphore, count is the number of readers inside
+ * or -1 for a writer. Waiters are served in FIFO order, so a new reader
+ * doesn't pass a waiting writer. */
+struct rw_semaphore {
+	struct wait_queue wait;
+	long count;
+};
+
+void rwsem_init(struct rw_semaphore *sem);
+void rwsem_down_read(struct rw_semaphore *sem);
+int rwsem_trydown_read(struct rw_semaphore *sem);
+void rwsem_up_read(struct rw_semaphore *sem);
+void rwsem_down_write(struct rw_semaphore *sem);
+int rwsem_trydown_write(struct rw_semaphore *sem);
+void rwsem_up_write(struct rw_semaphore *sem);
+
+#endif /*__RWSEM_H__*/
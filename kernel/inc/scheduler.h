@@ -1,9 +1,25 @@
 #ifndef __SCHEDULER_H__
 #define __SCHEDULER_H__
 
+#define SCHEDULER_SLICE	10
+#define SCHEDULER_WAKEUP_IRQ	2
+#define SCHEDULER_NICE_MIN	-20
+#define SCHEDULER_NICE_MAX	19
+
 struct thread;
 
+struct scheduler_stats {
+	unsigned long steal_attempts;
+	unsigned long steal_success;
+	unsigned long stolen;
+};
+
 void scheduler_activate_thread(struct thread *thread);
+void scheduler_switch_finish(struct thread *prev);
+unsigned long long scheduler_slice_end(void);
+void scheduler_wake_all(void);
+void scheduler_migrate(int cpu);
+unsigned long scheduler_nice_weight(int nice);
 
 void preempt_disable(void);
 void preempt_enable(void);
@@ -11,5 +27,7 @@ void schedule(void);
 
 void scheduler_setup(void);
 void scheduler_cpu_setup(void);
+void scheduler_stats(int cpu, struct scheduler_stats *stats);
+void scheduler_dump(void);
 
 #endif /*__SCHEDULER_H__*/
@@ -0,0 +1,26 @@
+#ifndef __SEMAPHORE_H__
+#define __SEMAPHORE_H__
+
+#include <wait.h>
+
+
+#define SEMAPHORE_FOREVER	(~0ull)
+
+/* Counting semaphore, waiters get units in FIFO order, so a large request
+ * isn't starved by a stream of small ones. */
+struct semaphore {
+	struct wait_queue wait;
+	unsigned long count;
+};
+
+void semaphore_init(struct semaphore *sem, unsigned long count);
+void semaphore_down(struct semaphore *sem, unsigned long units);
+int semaphore_trydown(struct semaphore *sem, unsigned long units);
+void semaphore_up(struct semaphore *sem, unsigned long units);
+
+/* returns 0 if units were taken and -1 if ticks passed before that,
+ * ticks may be SEMAPHORE_FOREVER */
+int semaphore_down_timeout(struct semaphore *sem, unsigned long units,
+			unsigned long long ticks);
+
+#endif /*__SEMAPHORE_H__*/
@@ -2,23 +2,46 @@
 #define __SPINLOCK_H__
 
 #include <stdatomic.h>
+#include <cpu.h>
 
+/* With LOCKSTAT every lock remembers its class, the place where it was
+ * initialized, and the statistics entry of the current holder. Reader
+ * side of rwlocks doesn't track hold time. */
+struct lockstat;
+
+struct lockstat_lock {
+	const void *class;
+	struct lockstat *stat;
+	unsigned long long acquired;
+};
+
+void lockstat_dump(void);
+
+/* Queued spinlock: the low byte is set while the lock is held and the
+ * upper half identifies the last waiter in the queue. Waiters spin on
+ * their own per cpu queue nodes instead of the lock word. */
 struct spinlock {
-	atomic_uint next;
-	atomic_uint current;
+	atomic_uint val;
+#ifdef LOCKSTAT
+	struct lockstat_lock stat;
+#endif
 };
 
 void spin_lock_init(struct spinlock *lock);
 unsigned long spin_lock_save(struct spinlock *lock);
 void spin_unlock_restore(struct spinlock *lock, unsigned long flags);
 void spin_lock(struct spinlock *lock);
+int spin_trylock(struct spinlock *lock);
 void spin_unlock(struct spinlock *lock);
 
 
+/* Writer preferring rwlock: readers take it with one atomic add and
+ * don't wait for each other, a waiting writer holds new readers off. */
 struct rwlock {
-	atomic_uint write;
-	atomic_uint read;
-	atomic_uint next;
+	atomic_uint val;
+#ifdef LOCKSTAT
+	struct lockstat_lock stat;
+#endif
 };
 
 void rwlock_init(struct rwlock *lock);
@@ -31,4 +54,56 @@ void read_unlock(struct rwlock *lock);
 void write_unlock_restore(struct rwlock *lock, unsigned long flags);
 void write_unlock(struct rwlock *lock);
 
+
+/* Big reader lock: readers only touch the counter of their own cpu and
+ * never write shared cache lines, writers have to wait for readers on
+ * every cpu. The reader counters can be shared by many locks, writers of
+ * different locks then don't exclude each other and wait only for readers
+ * that were inside at the moment. Readers always run with interrupts
+ * disabled and must not nest within the same counters. */
+struct brlock_cpu {
+	atomic_ulong seq;
+} __attribute__((aligned (64)));
+
+struct brlock_readers {
+	struct brlock_cpu cpu[MAX_CPU_NR];
+};
+
+struct brlock {
+	struct spinlock lock;
+	atomic_int writer;
+	struct brlock_readers *readers;
+};
+
+void brlock_readers_init(struct brlock_readers *readers);
+void brlock_init(struct brlock *lock, struct brlock_readers *readers);
+unsigned long br_read_lock_save(struct brlock *lock);
+void br_read_unlock_restore(struct brlock *lock, unsigned long flags);
+unsigned long br_write_lock_save(struct brlock *lock);
+void br_write_lock(struct brlock *lock);
+void br_write_unlock_restore(struct brlock *lock, unsigned long flags);
+void br_write_unlock(struct brlock *lock);
+
+
+/* Seqlock for read mostly data, readers don't write anything and retry
+ * if a writer was active meanwhile:
+ *
+ *	do {
+ *		seq = read_seqbegin(&lock);
+ *		copy the data
+ *	} while (read_seqretry(&lock, seq));
+ */
+struct seqlock {
+	atomic_uint seq;
+	struct spinlock lock;
+};
+
+void seqlock_init(struct seqlock *lock);
+unsigned read_seqbegin(const struct seqlock *lock);
+int read_seqretry(const struct seqlock *lock, unsigned seq);
+unsigned long write_seqlock_save(struct seqlock *lock);
+void write_seqlock(struct seqlock *lock);
+void write_sequnlock_restore(struct seqlock *lock, unsigned long flags);
+void write_sequnlock(struct seqlock *lock);
+
 #endif /*__SPINLOCK_H__*/
@@ -2,24 +2,62 @@
 #define __THREAD_H__
 
 #include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <rbtree.h>
+#include <wait.h>
 #include <list.h>
 
+/* Blocked thread may still be on its cpu, it becomes sleeping once its
+ * context is saved. Whoever makes the transition out of one of those
+ * decides who queues the thread when it's woken up. */
 enum thread_state {
 	THREAD_ACTIVE,
 	THREAD_BLOCKED,
+	THREAD_SLEEPING,
 	THREAD_FINISHING,
 	THREAD_FINISHED
 };
 
+enum thread_policy {
+	THREAD_FAIR,
+	THREAD_FIFO,
+	THREAD_RR
+};
+
+/* real time priorities, the higher the more urgent */
+#define THREAD_RT_PRIOS	64
+
 struct thread {
 	struct list_head ll;
 	unsigned long long timestamp;
 	uintptr_t stack_ptr;
 	uintptr_t stack_addr;
 	void *fpu_state;
-	int stack_order;
+	int fpu_cpu;
+	size_t stack_size;
 	atomic_int state;
+
+	/* fair scheduling class, times are in tsc cycles */
+	struct rb_node rb;
+	unsigned long long vruntime;
+	unsigned long long exec_start;
+	unsigned long long runtime;
+	unsigned long weight;
+	int nice;
+
+	/* real time classes, queued through ll */
+	int policy;
+	int rt_priority;
+
+	struct wait_queue join_wait;
+
+	/* cpus the thread may run on, the cpu it ran on last and the cpu it
+	 * asked to be moved to or -1 */
+	unsigned long affinity;
+	int cpu;
+	int migrate_cpu;
+	atomic_int on_cpu;
 };
 
 typedef void (*thread_fptr_t)(void *);
@@ -27,15 +65,28 @@ typedef void (*thread_fptr_t)(void *);
 void threads_setup(void);
 void threads_cpu_setup(void);
 
-struct thread *__thread_create(thread_fptr_t fptr, void *arg, int stack_order);
+struct thread *__thread_create(thread_fptr_t fptr, void *arg,
+			size_t stack_size);
 struct thread *thread_create(thread_fptr_t fptr, void *arg);
 void thread_join(struct thread *thread);
 void thread_destroy(struct thread *thread);
+int thread_stack_overflow(const struct thread *thread, uintptr_t addr);
 
 void thread_activate(struct thread *thread);
+int thread_wake(struct thread *thread);
 void thread_set_state(struct thread *thread, int state);
 int thread_get_state(struct thread *thread);
 
+void thread_set_nice(struct thread *thread, int nice);
+int thread_get_nice(struct thread *thread);
+void thread_set_policy(struct thread *thread, int policy, int priority);
+void thread_set_affinity(struct thread *thread, unsigned long affinity);
+unsigned long thread_get_affinity(struct thread *thread);
+void thread_migrate(int cpu);
+int thread_cpu(struct thread *thread);
+int thread_on_cpu(struct thread *thread);
+unsigned long long thread_cpu_time(struct thread *thread);
+
 struct thread *thread_current(void);
 void thread_switch_to(struct thread *target);
 
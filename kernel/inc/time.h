@@ -1,6 +1,8 @@
 #ifndef __TIME_H__
 #define __TIME_H__
 
+#include <list.h>
+
 /* NOTE: don't make it too large, because, for example, with value of 1000
    interrupts happens more often than requested, may be bug somewhere in
    QEMU hpet implementation? */
@@ -8,10 +10,27 @@
 #define TIMER_IRQ	0
 #define TIMER_LOCAL_IRQ	1
 
+/* timer runs from the local apic timer interrupt of the cpu it was added
+   on, expires is in current_time() units */
+struct timer {
+	struct list_head ll;
+	unsigned long long expires;
+	void (*fptr)(struct timer *);
+	int cpu;
+};
+
+void timer_setup(struct timer *timer, void (*fptr)(struct timer *));
+void timer_add(struct timer *timer, unsigned long long expires);
+int timer_del(struct timer *timer);
 
 void time_setup(void);
 void time_cpu_setup(void);
+void time_cpu_rearm(void);
+void time_set_tickless(int tickless);
+unsigned long time_cpu_ticks(int cpu);
+unsigned long long time_tick_cycles(void);
 void udelay(unsigned long usec);
+void time_sleep(unsigned long long ticks);
 unsigned long long current_time(void);
 
 #endif /*__TIME_H__*/
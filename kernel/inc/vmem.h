@@ -0,0 +1,29 @@
+#ifndef __VMEM_H__
+#define __VMEM_H__
+
+#include <stddef.h>
+#include <memory.h>
+
+/* Virtually contiguous kernel memory built from order 0 pages. It lives
+ * above any physical memory we can identity map. */
+#define VMEM_BEGIN	(1ull << 46)
+#define VMEM_END	HIGH_MEMORY
+
+/* every area is surrounded by unmapped guard pages of this size */
+#define VMEM_GUARD	PAGE_SIZE
+
+static inline int vmem_addr(const void *ptr)
+{
+	const uintptr_t addr = (uintptr_t)ptr;
+
+	return addr >= VMEM_BEGIN && addr < VMEM_END;
+}
+
+void *vmem_alloc(size_t size);
+void vmem_free(void *ptr);
+size_t vmem_size(const void *ptr);
+
+void vmem_cpu_tick(void);
+void vmem_setup(void);
+
+#endif /*__VMEM_H__*/
@@ -0,0 +1,47 @@
+#ifndef __WAIT_H__
+#define __WAIT_H__
+
+#include <spinlock.h>
+#include <list.h>
+
+
+struct thread;
+
+struct wait_queue {
+	struct spinlock lock;
+	struct list_head waiters;
+};
+
+struct wait_entry {
+	struct list_head ll;
+	struct thread *thread;
+};
+
+/* Waiting goes like this:
+ *
+ *	wait_entry_init(&wait);
+ *	while (1) {
+ *		wait_prepare(&queue, &wait);
+ *		if (condition)
+ *			break;
+ *		schedule();
+ *	}
+ *	wait_finish(&queue, &wait);
+ *
+ * while the waker makes the condition true before it calls wait_wake, so
+ * either the waiter sees the condition or the waker sees the waiter. */
+void wait_queue_init(struct wait_queue *queue);
+void wait_entry_init(struct wait_entry *wait);
+
+void wait_prepare(struct wait_queue *queue, struct wait_entry *wait);
+void wait_finish(struct wait_queue *queue, struct wait_entry *wait);
+struct thread *wait_wake(struct wait_queue *queue);
+int wait_wake_all(struct wait_queue *queue);
+
+/* the same, but queue->lock must be held by the caller */
+void __wait_prepare(struct wait_queue *queue, struct wait_entry *wait);
+void __wait_finish(struct wait_queue *queue, struct wait_entry *wait);
+struct thread *__wait_wake(struct wait_queue *queue);
+int __wait_wake_all(struct wait_queue *queue);
+
+#endif /*__WAIT_H__*/
@@ -1,22 +1,37 @@
+#include <scheduler.h>
 #include <limits.h>
 #include <memory.h>
 #include <string.h>
+#include <bitops.h>
+#include <thread.h>
 #include <alloc.h>
 #include <debug.h>
 #include <rbtree.h>
+#include <vmem.h>
+#include <time.h>
 
 
 #define WORD_SZ		sizeof(unsigned long long)
 #define OBJS_PER_WORD	(WORD_SZ * CHAR_BIT)
 #define MIN_POOL_OBJS	8
 #define PAGE_CACHE_BIT	0
+#define MAGAZINE_SIZE	32
+#define MAGAZINE_FILL	(MAGAZINE_SIZE / 2)
+#define MEM_CACHE_RESERVE	1
+#define MEM_RECLAIM_PERIOD	1000
 
 
+/* bitmask has a bit per object, set bit means busy object, it's followed by
+ * summary words with a bit per bitmask word, set bit means that the word has
+ * at least one free object. hint is the first summary word that might be
+ * non zero. */
 struct mem_pool {
 	struct list_head ll;
 	struct page *page;
 	void *data;
 	size_t free;
+	size_t hint;
+	int node;
 	unsigned long long bitmask[1];
 };
 
@@ -25,6 +40,24 @@ struct alignment_off {
 	struct mem_pool pool;
 };
 
+struct mem_magazine {
+	struct list_head ll;
+	int count;
+	void *objs[MAGAZINE_SIZE];
+};
+
+/* magazines themselves come from a cache without the magazine layer */
+static struct mem_cache mem_magazine_cache;
+
+static struct spinlock mem_caches_lock;
+static struct list_head mem_caches;
+
+static struct shrinker mem_cache_shrinker;
+static atomic_ulong mem_shrink_calls;
+static atomic_ulong mem_shrink_pages;
+static atomic_ulong mem_reclaim_runs;
+static atomic_ulong mem_reclaim_pages;
+
 static int ilog2(uintmax_t x)
 {
 	uintmax_t val = 1;
@@ -64,7 +97,9 @@ static size_t meta_size(size_t objs)
 {
 	static const size_t meta_align = offsetof(struct alignment_off, pool);
 
-	const size_t bitmask_size = (ceil(objs, OBJS_PER_WORD) - 1) * WORD_SZ;
+	const size_t words = ceil(objs, OBJS_PER_WORD);
+	const size_t summary_words = ceil(words, OBJS_PER_WORD);
+	const size_t bitmask_size = (words + summary_words - 1) * WORD_SZ;
 
 	return align_up(sizeof(struct mem_pool) + bitmask_size, meta_align);
 }
@@ -86,24 +121,40 @@ static void mem_cache_layout_setup(struct mem_cache *cache,
 	cache->meta_offs = pool_size - meta_size(objs);
 	cache->obj_count = objs;
 	cache->mask_words = ceil(objs, OBJS_PER_WORD);
+	cache->summary_words = ceil(cache->mask_words, OBJS_PER_WORD);
 	cache->obj_size = obj_size;
 	cache->pool_order = pool_order;
 }
 
+static unsigned long long *mem_pool_summary(const struct mem_cache *cache,
+			struct mem_pool *pool)
+{
+	return pool->bitmask + cache->mask_words;
+}
+
 static void mem_pool_bitmap_setup(struct mem_cache *cache,
 			struct mem_pool *pool)
 {
 	const size_t words = cache->mask_words;
 	const size_t pos = cache->obj_count % OBJS_PER_WORD;
 	const size_t word = cache->obj_count / OBJS_PER_WORD;
+	unsigned long long *summary = mem_pool_summary(cache, pool);
 
 	memset(pool->bitmask, 0, sizeof(pool->bitmask[0]) * words);
+	memset(summary, 0, sizeof(summary[0]) * cache->summary_words);
 
 	if (pos)
-		pool->bitmask[word] = ~((1ul << pos) - 1);
+		pool->bitmask[word] = ~((1ull << pos) - 1);
 
 	for (size_t w = word + 1; w < words; ++w)
-		pool->bitmask[w] = ~0ul;
+		pool->bitmask[w] = ~0ull;
+
+	for (size_t w = 0; w != words; ++w) {
+		if (pool->bitmask[w] == ~0ull)
+			continue;
+		summary[w / OBJS_PER_WORD] |= 1ull << (w % OBJS_PER_WORD);
+	}
+	pool->hint = 0;
 }
 
 static struct mem_pool *mem_pool_create(struct mem_cache *cache,
@@ -123,6 +174,7 @@ static struct mem_pool *mem_pool_create(struct mem_cache *cache,
 	}
 
 	meta->page = page;
+	meta->node = page_node(page);
 	meta->data = (void *)addr;
 	meta->free = cache->obj_count;
 	mem_pool_bitmap_setup(cache, meta);
@@ -144,67 +196,137 @@ static void mem_pool_destroy(struct mem_cache *cache, struct mem_pool *pool)
 	page_free((uintptr_t)pool->data, cache->pool_order);
 }
 
-void mem_cache_setup(struct mem_cache *cache, size_t size, size_t align)
+static void __mem_cache_setup(struct mem_cache *cache, size_t size,
+			size_t align, int magazines)
 {
 	mem_cache_layout_setup(cache, size, align);
 
 	spin_lock_init(&cache->lock);
-	list_init(&cache->free_pools);
-	list_init(&cache->partial_pools);
+	for (int i = 0; i != MAX_NODES; ++i) {
+		list_init(&cache->free_pools[i]);
+		list_init(&cache->partial_pools[i]);
+	}
 	list_init(&cache->busy_pools);
+	list_init(&cache->full_magazines);
+	list_init(&cache->empty_magazines);
+
+	for (int i = 0; i != MAX_CPU_NR; ++i) {
+		cache->cpu[i].loaded = 0;
+		cache->cpu[i].prev = 0;
+	}
+	cache->magazines = magazines;
+	cache->free_count = 0;
+	cache->reserve = MEM_CACHE_RESERVE;
+
+	const unsigned long flags = spin_lock_save(&mem_caches_lock);
+
+	list_add_tail(&cache->ll, &mem_caches);
+	spin_unlock_restore(&mem_caches_lock, flags);
 }
 
-void mem_cache_release(struct mem_cache *cache)
+void mem_cache_setup(struct mem_cache *cache, size_t size, size_t align)
 {
-	BUG_ON(!list_empty(&cache->busy_pools));
-	BUG_ON(!list_empty(&cache->partial_pools));
+	__mem_cache_setup(cache, size, align, /* magazines = */1);
+}
 
-	struct list_head *head = &cache->free_pools;
+void mem_cache_set_reserve(struct mem_cache *cache, size_t pools)
+{
+	cache->reserve = pools;
+}
 
+static void __mem_cache_free(struct mem_cache *cache, void *ptr);
+
+static void mem_magazine_release(struct mem_cache *cache,
+			struct mem_magazine *mag)
+{
+	if (!mag)
+		return;
+
+	for (int i = 0; i != mag->count; ++i)
+		__mem_cache_free(cache, mag->objs[i]);
+	mem_cache_free(&mem_magazine_cache, mag);
+}
+
+static void mem_magazine_list_release(struct mem_cache *cache,
+			struct list_head *head)
+{
 	for (struct list_head *ptr = head->next; ptr != head;) {
-		struct mem_pool *pool = LIST_ENTRY(ptr, struct mem_pool, ll);
+		struct mem_magazine *mag = LIST_ENTRY(ptr,
+					struct mem_magazine, ll);
 
 		ptr = ptr->next;
-		mem_pool_destroy(cache, pool);
+		mem_magazine_release(cache, mag);
 	}
+	list_init(head);
 }
 
-static int ffs(unsigned long long bitmask)
+static void mem_cache_magazines_release(struct mem_cache *cache)
 {
-	unsigned long long mask = 0xffull;
-	int byte, bit;
+	const unsigned long flags = spin_lock_save(&cache->lock);
+
+	for (int i = 0; i != MAX_CPU_NR; ++i) {
+		struct mem_cache_cpu *cpu = &cache->cpu[i];
+
+		mem_magazine_release(cache, cpu->loaded);
+		mem_magazine_release(cache, cpu->prev);
+		cpu->loaded = cpu->prev = 0;
+	}
+	mem_magazine_list_release(cache, &cache->full_magazines);
+	mem_magazine_list_release(cache, &cache->empty_magazines);
+	spin_unlock_restore(&cache->lock, flags);
+}
+
+void mem_cache_release(struct mem_cache *cache)
+{
+	const unsigned long flags = spin_lock_save(&mem_caches_lock);
+
+	list_del(&cache->ll);
+	spin_unlock_restore(&mem_caches_lock, flags);
+
+	if (cache->magazines)
+		mem_cache_magazines_release(cache);
+
+	BUG_ON(!list_empty(&cache->busy_pools));
 
-	for (byte = 0; byte != 8; ++byte, mask <<= 8)
-		if (bitmask & mask)
-			break;
+	for (int node = 0; node != MAX_NODES; ++node) {
+		struct list_head *head = &cache->free_pools[node];
 
-	mask = 0x01ull << (byte * 8);
-	for (bit = 0; bit != 8; ++bit, mask <<= 1)
-		if (bitmask & mask)
-			break;
+		BUG_ON(!list_empty(&cache->partial_pools[node]));
+		for (struct list_head *ptr = head->next; ptr != head;) {
+			struct mem_pool *pool = LIST_ENTRY(ptr,
+						struct mem_pool, ll);
 
-	return byte * 8 + bit;
+			ptr = ptr->next;
+			mem_pool_destroy(cache, pool);
+		}
+	}
 }
 
 static void *mem_pool_alloc(struct mem_cache *cache, struct mem_pool *pool)
 {
 	BUG_ON(!pool->free);
 
-	const size_t words = cache->mask_words;
+	const size_t summary_words = cache->summary_words;
+	unsigned long long *summary = mem_pool_summary(cache, pool);
+	size_t sword = pool->hint;
 
-	for (size_t word = 0; word != words; ++word) {
-		if (pool->bitmask[word] == ~0ul)
-			continue;
+	while (sword != summary_words && !summary[sword])
+		++sword;
 
-		const size_t bit = ffs(~pool->bitmask[word]);
-		const size_t pos = OBJS_PER_WORD * word + bit;
-		const uintptr_t addr = (uintptr_t)pool->data;
+	if (sword == summary_words)
+		BUG("Failed to find free slot in mem_pool");
 
-		pool->bitmask[word] |= (1ul << bit);
-		--pool->free;
-		return (void *)(addr + pos * cache->obj_size);
-	}
-	BUG("Failed to find free slot in mem_pool")
+	const size_t word = OBJS_PER_WORD * sword + bsf(summary[sword]);
+	const size_t bit = bsf(~pool->bitmask[word]);
+	const size_t pos = OBJS_PER_WORD * word + bit;
+	const uintptr_t addr = (uintptr_t)pool->data;
+
+	pool->bitmask[word] |= (1ull << bit);
+	if (pool->bitmask[word] == ~0ull)
+		summary[sword] &= ~(1ull << (word % OBJS_PER_WORD));
+	pool->hint = sword;
+	--pool->free;
+	return (void *)(addr + pos * cache->obj_size);
 }
 
 static void mem_pool_free(struct mem_cache *cache, struct mem_pool *pool,
@@ -217,60 +339,199 @@ static void mem_pool_free(struct mem_cache *cache, struct mem_pool *pool,
 
 	size_t word = pos / OBJS_PER_WORD;
 	size_t bit = pos % OBJS_PER_WORD;
+	size_t sword = word / OBJS_PER_WORD;
 
 	BUG_ON(!(pool->bitmask[word] & (1ull << bit)));
 
 	pool->bitmask[word] &= ~(1ull << bit);
+	mem_pool_summary(cache, pool)[sword] |= 1ull << (word % OBJS_PER_WORD);
+	if (sword < pool->hint)
+		pool->hint = sword;
 	++pool->free;
 
 	BUG_ON(pool->free > cache->obj_count);
 }
 
-static void *__mem_cache_alloc(struct mem_cache *cache, unsigned long flags)
+static struct mem_pool *mem_cache_node_pool(struct mem_cache *cache, int node)
 {
-	if (!list_empty(&cache->partial_pools)) {
-		struct list_head *ptr = list_first(&cache->partial_pools);
-		struct mem_pool *pool = LIST_ENTRY(ptr, struct mem_pool, ll);
+	struct list_head *head = &cache->partial_pools[node];
 
-		void *data = mem_pool_alloc(cache, pool);
+	if (list_empty(head))
+		head = &cache->free_pools[node];
 
-		if (!pool->free) {
-			list_del(&pool->ll);
-			list_add(&pool->ll, &cache->busy_pools);
-		}
-		return data;
-	}
+	if (list_empty(head))
+		return 0;
+	return LIST_ENTRY(list_first(head), struct mem_pool, ll);
+}
 
-	if (!list_empty(&cache->free_pools)) {
-		struct list_head *ptr = list_first(&cache->free_pools);
-		struct mem_pool *pool = LIST_ENTRY(ptr, struct mem_pool, ll);
+/* Pools of the local node go first, then a new pool which the page
+ * allocator tries to place on the local node too and only then pools of
+ * other nodes from the closest to the farthest. */
+static struct mem_pool *mem_cache_find_pool(struct mem_cache *cache,
+			unsigned long flags)
+{
+	const int node = numa_node();
+	struct mem_pool *pool = mem_cache_node_pool(cache, node);
 
-		void *data = mem_pool_alloc(cache, pool);
+	if (pool)
+		return pool;
 
-		if (pool->free != cache->obj_count) {
-			list_del(&pool->ll);
-			list_add(&pool->ll, &cache->partial_pools);
-		}
-		return data;
+	if ((pool = mem_pool_create(cache, flags))) {
+		list_add(&pool->ll, &cache->free_pools[pool->node]);
+		++cache->free_count;
+		return pool;
 	}
 
-	struct mem_pool *pool = mem_pool_create(cache, flags);
+	const int *nodes = numa_node_order(node);
+
+	for (int i = 1; i != numa_nodes(); ++i) {
+		if ((pool = mem_cache_node_pool(cache, nodes[i])))
+			return pool;
+	}
+	return 0;
+}
+
+static void *__mem_cache_alloc(struct mem_cache *cache, unsigned long flags)
+{
+	struct mem_pool *pool = mem_cache_find_pool(cache, flags);
 
 	if (!pool)
 		return 0;
 
+	const int was_free = pool->free == cache->obj_count;
 	void *data = mem_pool_alloc(cache, pool);
 
-	list_add(&pool->ll, &cache->partial_pools);
+	if (was_free)
+		--cache->free_count;
+
+	if (!pool->free) {
+		list_del(&pool->ll);
+		list_add(&pool->ll, &cache->busy_pools);
+	} else if (was_free) {
+		list_del(&pool->ll);
+		list_add(&pool->ll, &cache->partial_pools[pool->node]);
+	}
 	return data;
 }
 
+static struct mem_magazine *mem_magazine_get(struct mem_cache *cache)
+{
+	struct mem_magazine *mag = 0;
+
+	spin_lock(&cache->lock);
+	if (!list_empty(&cache->empty_magazines)) {
+		struct list_head *ptr = list_first(&cache->empty_magazines);
+
+		list_del(ptr);
+		mag = LIST_ENTRY(ptr, struct mem_magazine, ll);
+	}
+	spin_unlock(&cache->lock);
+
+	if (mag)
+		return mag;
+
+	mag = mem_cache_alloc(&mem_magazine_cache, PA_ANY);
+	if (mag)
+		mag->count = 0;
+	return mag;
+}
+
+static void *__mem_cache_cpu_alloc(struct mem_cache *cache,
+			struct mem_cache_cpu *cpu, unsigned long flags)
+{
+	struct mem_magazine *mag = cpu->loaded;
+
+	if (mag && mag->count)
+		return mag->objs[--mag->count];
+
+	if (cpu->prev && cpu->prev->count) {
+		cpu->loaded = cpu->prev;
+		cpu->prev = mag;
+		mag = cpu->loaded;
+		return mag->objs[--mag->count];
+	}
+
+	if (!mag && cpu->prev) {
+		mag = cpu->loaded = cpu->prev;
+		cpu->prev = 0;
+	}
+
+	if (!mag && !(mag = cpu->loaded = mem_magazine_get(cache)))
+		return 0;
+
+	spin_lock(&cache->lock);
+	if (!list_empty(&cache->full_magazines)) {
+		struct list_head *ptr = list_first(&cache->full_magazines);
+
+		list_del(ptr);
+		if (cpu->prev)
+			list_add(&cpu->prev->ll, &cache->empty_magazines);
+		cpu->prev = mag;
+		mag = cpu->loaded = LIST_ENTRY(ptr, struct mem_magazine, ll);
+	} else {
+		while (mag->count != MAGAZINE_FILL) {
+			void *obj = __mem_cache_alloc(cache, flags);
+
+			if (!obj)
+				break;
+			mag->objs[mag->count++] = obj;
+		}
+	}
+	spin_unlock(&cache->lock);
+
+	return mag->count ? mag->objs[--mag->count] : 0;
+}
+
+static int __mem_cache_cpu_free(struct mem_cache *cache,
+			struct mem_cache_cpu *cpu, void *ptr)
+{
+	struct mem_magazine *mag = cpu->loaded;
+
+	if (mag && mag->count != MAGAZINE_SIZE) {
+		mag->objs[mag->count++] = ptr;
+		return 0;
+	}
+
+	if (cpu->prev && cpu->prev->count != MAGAZINE_SIZE) {
+		cpu->loaded = cpu->prev;
+		cpu->prev = mag;
+		mag = cpu->loaded;
+		mag->objs[mag->count++] = ptr;
+		return 0;
+	}
+
+	struct mem_magazine *empty = mem_magazine_get(cache);
+
+	if (!empty)
+		return -1;
+
+	if (cpu->prev) {
+		spin_lock(&cache->lock);
+		list_add(&cpu->prev->ll, &cache->full_magazines);
+		spin_unlock(&cache->lock);
+	}
+
+	cpu->prev = mag;
+	cpu->loaded = empty;
+	empty->objs[empty->count++] = ptr;
+	return 0;
+}
+
 void *mem_cache_alloc(struct mem_cache *cache, unsigned long alloc_flags)
 {
-	const unsigned long flags = spin_lock_save(&cache->lock);
-	void *data = __mem_cache_alloc(cache, alloc_flags);
+	const unsigned long flags = local_int_save();
+	void *data = 0;
 
-	spin_unlock_restore(&cache->lock, flags);
+	if (cache->magazines)
+		data = __mem_cache_cpu_alloc(cache, &cache->cpu[cpu_id()],
+					alloc_flags);
+
+	if (!data) {
+		spin_lock(&cache->lock);
+		data = __mem_cache_alloc(cache, alloc_flags);
+		spin_unlock(&cache->lock);
+	}
+	local_int_restore(flags);
 	return data;
 }
 
@@ -284,25 +545,162 @@ static void __mem_cache_free(struct mem_cache *cache, void *ptr)
 
 	if (pool->free == 1) {
 		list_del(&pool->ll);
-		list_add(&pool->ll, &cache->partial_pools);
+		list_add(&pool->ll, &cache->partial_pools[pool->node]);
 	}
 
 	if (pool->free == cache->obj_count) {
 		list_del(&pool->ll);
-		list_add(&pool->ll, &cache->free_pools);
+		list_add(&pool->ll, &cache->free_pools[pool->node]);
+		++cache->free_count;
 	}
 }
 
 void mem_cache_free(struct mem_cache *cache, void *ptr)
+{
+	const unsigned long flags = local_int_save();
+
+	if (!cache->magazines ||
+			__mem_cache_cpu_free(cache, &cache->cpu[cpu_id()], ptr)) {
+		spin_lock(&cache->lock);
+		__mem_cache_free(cache, ptr);
+		spin_unlock(&cache->lock);
+	}
+	local_int_restore(flags);
+}
+
+
+/* Objects sitting in full depot magazines keep their pools busy, so put
+ * them back first and then release free pools above keep. */
+static unsigned long __mem_cache_shrink(struct mem_cache *cache, size_t keep)
+{
+	struct list_head *head = &cache->full_magazines;
+	unsigned long pages = 0;
+
+	while (!list_empty(head)) {
+		struct mem_magazine *mag = LIST_ENTRY(list_first(head),
+					struct mem_magazine, ll);
+
+		for (int i = 0; i != mag->count; ++i)
+			__mem_cache_free(cache, mag->objs[i]);
+		mag->count = 0;
+		list_del(&mag->ll);
+		list_add(&mag->ll, &cache->empty_magazines);
+	}
+
+	for (int node = 0; node != MAX_NODES; ++node) {
+		struct list_head *head = &cache->free_pools[node];
+
+		while (cache->free_count > keep && !list_empty(head)) {
+			struct list_head *ptr = list_first(head);
+			struct mem_pool *pool = LIST_ENTRY(ptr,
+						struct mem_pool, ll);
+
+			list_del(ptr);
+			--cache->free_count;
+			mem_pool_destroy(cache, pool);
+			pages += (unsigned long)1 << cache->pool_order;
+		}
+	}
+	return pages;
+}
+
+unsigned long mem_cache_shrink(struct mem_cache *cache, size_t keep)
 {
 	const unsigned long flags = spin_lock_save(&cache->lock);
+	const unsigned long pages = __mem_cache_shrink(cache, keep);
 
-	__mem_cache_free(cache, ptr);
 	spin_unlock_restore(&cache->lock, flags);
+	return pages;
+}
+
+/* It may be called from inside of the allocator with some cache lock held,
+ * so skip busy caches instead of waiting for them. */
+static unsigned long mem_cache_shrink_all(struct shrinker *shrinker,
+			unsigned long pages)
+{
+	struct list_head *head = &mem_caches;
+	unsigned long freed = 0;
+
+	(void) shrinker;
+
+	spin_lock(&mem_caches_lock);
+	for (struct list_head *ptr = head->next; ptr != head && freed < pages;
+				ptr = ptr->next) {
+		struct mem_cache *cache = LIST_ENTRY(ptr, struct mem_cache, ll);
+
+		if (!spin_trylock(&cache->lock))
+			continue;
+		freed += __mem_cache_shrink(cache, 0);
+		spin_unlock(&cache->lock);
+	}
+	spin_unlock(&mem_caches_lock);
+
+	atomic_fetch_add_explicit(&mem_shrink_calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&mem_shrink_pages, freed,
+				memory_order_relaxed);
+	return freed;
+}
+
+static void mem_cache_reclaim(void)
+{
+	const unsigned long flags = spin_lock_save(&mem_caches_lock);
+	struct list_head *head = &mem_caches;
+	unsigned long freed = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head;
+				ptr = ptr->next) {
+		struct mem_cache *cache = LIST_ENTRY(ptr, struct mem_cache, ll);
+
+		/* the cache owner might be waiting for mem_caches_lock in
+		 * the shrinker while holding cache lock */
+		if (!spin_trylock(&cache->lock))
+			continue;
+		freed += __mem_cache_shrink(cache, cache->reserve);
+		spin_unlock(&cache->lock);
+	}
+	spin_unlock_restore(&mem_caches_lock, flags);
+
+	atomic_fetch_add_explicit(&mem_reclaim_runs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&mem_reclaim_pages, freed,
+				memory_order_relaxed);
+}
+
+static void mem_reclaim_thread(void *unused)
+{
+	(void) unused;
+
+	while (1) {
+		mem_cache_reclaim();
+		time_sleep(MEM_RECLAIM_PERIOD);
+	}
+}
+
+void mem_reclaim_setup(void)
+{
+	struct thread *thread = thread_create(&mem_reclaim_thread, 0);
+
+	BUG_ON(!thread);
+	/* background work, shouldn't take much from anybody else */
+	thread_set_nice(thread, 10);
+	thread_activate(thread);
+}
+
+void mem_reclaim_stats(struct mem_reclaim_stats *stats)
+{
+	stats->shrink_calls = atomic_load_explicit(&mem_shrink_calls,
+				memory_order_relaxed);
+	stats->shrink_pages = atomic_load_explicit(&mem_shrink_pages,
+				memory_order_relaxed);
+	stats->reclaim_runs = atomic_load_explicit(&mem_reclaim_runs,
+				memory_order_relaxed);
+	stats->reclaim_pages = atomic_load_explicit(&mem_reclaim_pages,
+				memory_order_relaxed);
 }
 
 
 #define MEM_POOLS	(sizeof(mem_pool_size) / sizeof(mem_pool_size[0]))
+#define MEM_CLASS_SHIFT	6
+#define MEM_CLASSES	(MEM_POOLS + MAX_ORDER + 1)
 
 static size_t mem_pool_size[] = {
 	64,   128,  192,  256,  320,  384,  448,
@@ -313,28 +711,168 @@ static size_t mem_pool_size[] = {
 };
 static struct mem_cache mem_pool[MEM_POOLS];
 
+/* All pool sizes are multiples of 1 << MEM_CLASS_SHIFT, so the smallest
+ * pool that fits size is mem_pool_index[ceil(size, 1 << MEM_CLASS_SHIFT)].
+ * mem_alloc_setup checks that the table matches mem_pool_size. */
+static const uint8_t mem_pool_index[] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23,
+	23, 24, 24, 24, 24, 25, 25, 25, 25, 26, 26, 26, 26, 27, 27, 27,
+	27, 28, 28, 28, 28, 28, 28, 28, 28, 29, 29, 29, 29, 29, 29, 29,
+	29, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+	30, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31,
+	31, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+	32, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+	33
+};
+
+/* first MEM_POOLS classes are pools, the rest are page orders */
+struct mem_class_stats {
+	atomic_ulong count;
+	atomic_ulong bytes;
+	atomic_ulong reserved;
+};
+
+static struct mem_class_stats mem_class_stats[MAX_CPU_NR][MEM_CLASSES];
+
+/* requested vs reserved bytes per call site, open addressing on site */
+#define MEM_FRAG_SITES	64
 
-static struct mem_cache *mem_pool_lookup(size_t size)
+struct mem_frag_site {
+	atomic_uintptr_t site;
+	atomic_ulong count;
+	atomic_ulong requested;
+	atomic_ulong reserved;
+};
+
+static struct mem_frag_site mem_frag_sites[MEM_FRAG_SITES];
+static atomic_ulong mem_frag_dropped;
+
+
+static int mem_pool_class(size_t size)
 {
-	for (int i = 0; i != MEM_POOLS; ++i)
-		if (mem_pool_size[i] >= size)
-			return &mem_pool[i];
-	return 0;
+	const size_t max_size = mem_pool_size[MEM_POOLS - 1];
+
+	if (size > max_size)
+		return -1;
+	return mem_pool_index[ceil(size, (size_t)1 << MEM_CLASS_SHIFT)];
 }
 
 static int mem_order_calculate(size_t size)
 {
-	int order;
+	if (size <= PAGE_SIZE)
+		return 0;
+	return bsr(size - 1) + 1 - PAGE_SHIFT;
+}
+
+static void mem_class_account(int class, size_t size, size_t reserved)
+{
+	struct mem_class_stats *stats = &mem_class_stats[cpu_id()][class];
+
+	atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->bytes, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->reserved, reserved,
+				memory_order_relaxed);
+}
+
+static struct mem_frag_site *mem_frag_site(uintptr_t site)
+{
+	const size_t hash = (site * 0x9e3779b97f4a7c15ull) >> 58;
+
+	for (size_t i = 0; i != MEM_FRAG_SITES; ++i) {
+		struct mem_frag_site *entry =
+			&mem_frag_sites[(hash + i) % MEM_FRAG_SITES];
+		uintptr_t old = atomic_load_explicit(&entry->site,
+					memory_order_relaxed);
+
+		if (!old && atomic_compare_exchange_strong_explicit(
+					&entry->site, &old, site,
+					memory_order_relaxed,
+					memory_order_relaxed))
+			return entry;
+
+		if (old == site)
+			return entry;
+	}
+	return 0;
+}
+
+void mem_frag_account(const void *site, size_t requested, size_t reserved)
+{
+	struct mem_frag_site *entry = mem_frag_site((uintptr_t)site);
+
+	if (!entry) {
+		atomic_fetch_add_explicit(&mem_frag_dropped, 1,
+					memory_order_relaxed);
+		return;
+	}
+
+	atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->requested, requested,
+				memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->reserved, reserved,
+				memory_order_relaxed);
+}
+
+void mem_frag_dump(void)
+{
+	printf("allocation sites:\n");
+	for (int i = 0; i != MEM_FRAG_SITES; ++i) {
+		struct mem_frag_site *entry = &mem_frag_sites[i];
+		const uintptr_t site = atomic_load_explicit(&entry->site,
+					memory_order_relaxed);
+
+		if (!site)
+			continue;
+
+		const unsigned long count = atomic_load_explicit(
+					&entry->count, memory_order_relaxed);
+		const unsigned long requested = atomic_load_explicit(
+					&entry->requested, memory_order_relaxed);
+		const unsigned long reserved = atomic_load_explicit(
+					&entry->reserved, memory_order_relaxed);
+		const unsigned long wasted = reserved - requested;
+
+		printf("    site 0x%lx: %lu allocs, %lu bytes requested, "
+					"%lu bytes reserved, %lu%% wasted\n",
+					(unsigned long)site, count, requested,
+					reserved,
+					reserved ? wasted * 100 / reserved : 0);
+	}
+
+	const unsigned long dropped = atomic_load_explicit(&mem_frag_dropped,
+				memory_order_relaxed);
+
+	if (dropped)
+		printf("    %lu allocs from untracked sites\n", dropped);
+}
 
-	for (order = 0; order != MAX_ORDER + 1; ++order)
+static void mem_alloc_index_check(void)
+{
+	const size_t entries = sizeof(mem_pool_index) / sizeof(mem_pool_index[0]);
+
+	BUG_ON((entries - 1) << MEM_CLASS_SHIFT != mem_pool_size[MEM_POOLS - 1]);
 
-		if (((size_t)1 << (order + PAGE_SHIFT)) >= size)
-			break;
-	return order;
+	for (size_t i = 0; i != entries; ++i) {
+		const size_t size = i << MEM_CLASS_SHIFT;
+		const int class = mem_pool_index[i];
+
+		BUG_ON(mem_pool_size[class] < size);
+		BUG_ON(class && mem_pool_size[class - 1] >= size);
+	}
 }
 
 void mem_alloc_setup(void)
 {
+	mem_alloc_index_check();
+	spin_lock_init(&mem_caches_lock);
+	list_init(&mem_caches);
+
+	mem_cache_shrinker.shrink = &mem_cache_shrink_all;
+	register_shrinker(&mem_cache_shrinker);
+	__mem_cache_setup(&mem_magazine_cache, sizeof(struct mem_magazine),
+				sizeof(void *), /* magazines = */0);
+
 	for (int i = 0; i != MEM_POOLS; ++i) {
 		const size_t size = mem_pool_size[i];
 		const size_t align = mem_pool_size[0];
@@ -345,19 +883,33 @@ void mem_alloc_setup(void)
 
 void *mem_alloc(size_t size)
 {
-	struct mem_cache *cache = mem_pool_lookup(size);
+	const void *site = __builtin_return_address(0);
+	const int class = mem_pool_class(size);
 
-	if (cache)
-		return mem_cache_alloc(cache, PA_ANY);
+	if (class >= 0) {
+		mem_class_account(class, size, mem_pool_size[class]);
+		mem_frag_account(site, size, mem_pool_size[class]);
+		return mem_cache_alloc(&mem_pool[class], PA_ANY);
+	}
 
 	const int order = mem_order_calculate(size);
-	struct page *page = __page_alloc(order, PA_ANY);
 
-	if (!page)
+	if (order > MAX_ORDER)
 		return 0;
 
+	const size_t pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	mem_class_account(MEM_POOLS + order, size, pages << PAGE_SHIFT);
+	mem_frag_account(site, size, pages << PAGE_SHIFT);
+
+	struct page *page = __page_alloc_pages(pages, PA_ANY);
+
+	/* there is no free block large enough, so build it from pages */
+	if (!page)
+		return vmem_alloc(size);
+
 	page_clear_bit(page, PAGE_CACHE_BIT);
-	page->u.order = order;
+	page->u.pages = pages;
 
 	return (void *)page_addr(page);
 }
@@ -367,6 +919,11 @@ void mem_free(void *ptr)
 	if (!ptr)
 		return;
 
+	if (vmem_addr(ptr)) {
+		vmem_free(ptr);
+		return;
+	}
+
 	struct page *page = addr_page((uintptr_t)ptr & ~(uintptr_t)PAGE_MASK);
 
 	if (page_test_bit(page, PAGE_CACHE_BIT)) {
@@ -374,35 +931,36 @@ void mem_free(void *ptr)
 		return;
 	}
 
-	const int order = page->u.order;
-	const uintptr_t mask = (1ull << (order + PAGE_SHIFT)) - 1;
+	const size_t pages = page->u.pages;
 
-	page_clear_bit(page, PAGE_CACHE_BIT);
-	page->u.order = 0;
-	page_free((~mask & (uintptr_t)ptr), order);
+	page->u.pages = 0;
+	__page_free_pages(page, pages);
 }
 
-void *mem_realloc(void *ptr, size_t size)
+static size_t mem_alloc_size(const void *ptr)
 {
-	if (!ptr)
-		return mem_alloc(size);
+	if (vmem_addr(ptr))
+		return vmem_size(ptr);
 
 	struct page *page = addr_page((uintptr_t)ptr & ~(uintptr_t)PAGE_MASK);
-	size_t old_size;
 
 	if (page_test_bit(page, PAGE_CACHE_BIT)) {
 		struct mem_cache *cache = page->u.cache;
 
-		old_size = cache->obj_size;
-		if (old_size >= size)
-			return ptr;
-	} else {
-		const int order = page->u.order;
-
-		old_size = (size_t)1 << (PAGE_SHIFT + order);
-		if (old_size >= size)
-			return ptr;
+		return cache->obj_size;
 	}
+	return page->u.pages << PAGE_SHIFT;
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return mem_alloc(size);
+
+	const size_t old_size = mem_alloc_size(ptr);
+
+	if (old_size >= size)
+		return ptr;
 
 	void *new = mem_alloc(size);
 
@@ -413,3 +971,45 @@ void *mem_realloc(void *ptr, size_t size)
 	mem_free(ptr);
 	return new;
 }
+
+void mem_alloc_dump(void)
+{
+	struct mem_reclaim_stats stats;
+
+	mem_reclaim_stats(&stats);
+	printf("mem_cache reclaim: %lu shrinks freed %lu pages, "
+				"%lu runs freed %lu pages\n",
+				stats.shrink_calls, stats.shrink_pages,
+				stats.reclaim_runs, stats.reclaim_pages);
+
+	printf("mem_alloc size classes:\n");
+	for (int class = 0; class != MEM_CLASSES; ++class) {
+		unsigned long count = 0, bytes = 0, reserved = 0;
+
+		for (int cpu = 0; cpu != MAX_CPU_NR; ++cpu) {
+			struct mem_class_stats *stats =
+						&mem_class_stats[cpu][class];
+
+			count += atomic_load_explicit(&stats->count,
+						memory_order_relaxed);
+			bytes += atomic_load_explicit(&stats->bytes,
+						memory_order_relaxed);
+			reserved += atomic_load_explicit(&stats->reserved,
+						memory_order_relaxed);
+		}
+
+		if (!count)
+			continue;
+
+		const unsigned long size = class < (int)MEM_POOLS
+					? mem_pool_size[class]
+					: ((unsigned long)PAGE_SIZE
+						<< (class - MEM_POOLS));
+
+		printf("    class %lu: %lu allocs, %lu bytes requested, "
+					"%lu bytes reserved\n", size, count,
+					bytes, reserved);
+	}
+
+	mem_frag_dump();
+}
@@ -30,8 +30,7 @@ void backtrace(void)
 	if (!thread)
 		return;
 
-	const int order = thread->stack_order + PAGE_SHIFT;
-	const uintptr_t size = 1ul << order;
+	const uintptr_t size = thread->stack_size;
 	const uintptr_t begin = thread->stack_addr;
 	const uintptr_t end = begin + size;
 
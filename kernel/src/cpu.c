@@ -9,12 +9,21 @@
 #include <apic.h>
 #include <time.h>
 #include <fpu.h>
+#include <vmem.h>
+#include <ints.h>
 #include <cpu.h>
 #include <rcu.h>
 
 
+#define EXCEPTION_STACK_SIZE	(2 * PAGE_SIZE)
+
 struct tss {
-	uint8_t reserved[102];
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
 	uint16_t iomap_offs;
 	uint8_t iomap[1];
 } __attribute__((packed));
@@ -52,6 +61,22 @@ static void gdt_setup(struct gdt *gdt, struct tss *tss)
 	tss_segment_setup(tss);
 }
 
+static void __gdt_cpu_setup(struct gdt *gdt, struct tss *tss, char *stack,
+			char *df_stack)
+{
+	const struct desc_ptr ptr = {
+		.base = (uint64_t)gdt, .limit = sizeof(*gdt) - 1
+	};
+
+	gdt_setup(gdt, tss);
+	tss->ist[INT_EXCEPTION_IST - 1] = (uintptr_t)(stack +
+				EXCEPTION_STACK_SIZE);
+	tss->ist[INT_DOUBLE_FAULT_IST - 1] = (uintptr_t)(df_stack +
+				EXCEPTION_STACK_SIZE);
+	write_gdt(&ptr);
+	write_tr(KERNEL_TSS);
+}
+
 static void gdt_cpu_setup(void)
 {
 	const size_t gdt_size = sizeof(struct gdt);
@@ -60,14 +85,23 @@ static void gdt_cpu_setup(void)
 	struct gdt *gdt = mem_alloc(gdt_size + tss_size);
 	BUG_ON(!gdt);
 	struct tss *tss = (struct tss *)(gdt + 1);
+	char *stack = vmem_alloc(EXCEPTION_STACK_SIZE);
+	char *df_stack = vmem_alloc(EXCEPTION_STACK_SIZE);
 
-	const struct desc_ptr ptr = {
-		.base = (uint64_t)gdt, .limit = gdt_size - 1
-	};
+	BUG_ON(!stack || !df_stack);
+	__gdt_cpu_setup(gdt, tss, stack, df_stack);
+}
 
-	gdt_setup(gdt, tss);
-	write_gdt(&ptr);
-	write_tr(KERNEL_TSS);
+/* #PF and #DF switch to the IST stacks from the very first IDT, so the
+ * boot cpu needs a TSS before there is an allocator to take it from. */
+void cpu_early_setup(void)
+{
+	static struct gdt gdt __attribute__((aligned(16)));
+	static struct tss tss __attribute__((aligned(16)));
+	static char stack[EXCEPTION_STACK_SIZE] __attribute__((aligned(16)));
+	static char df_stack[EXCEPTION_STACK_SIZE] __attribute__((aligned(16)));
+
+	__gdt_cpu_setup(&gdt, &tss, stack, df_stack);
 }
 
 static __percpu int this_cpu_id;
@@ -1,3 +1,4 @@
+#include <alloc.h>
 #include <fpu.h>
 #include <cpu.h>
 #include <debug.h>
@@ -8,6 +9,10 @@
 
 #define CPUID_XSAVE	(1ul << 26)
 #define CPUID_XSAVEOPT	(1ul << 0)
+#define CPUID_XSAVES	(1ul << 3)
+
+#define IA32_XSS	0xda0
+#define XCOMP_BV_COMPACT	(1ull << 63)
 
 #define X87_FPU_MASK	(1ull << 0)
 #define SSE_MASK	(1ull << 1)
@@ -30,8 +35,39 @@ struct xsave_area {
 	struct xsave_hdr xsave_hdr;
 } __attribute__((packed));
 
+enum fpu_save_insn {
+	FPU_XSAVE,
+	FPU_XSAVEOPT,
+	FPU_XSAVES,
+};
+
+static const char *fpu_save_insn_names[] = {
+	"xsave", "xsaveopt", "xsaves"
+};
+
 static unsigned long long xcr0_features;
 static int state_size;
+static enum fpu_save_insn save_insn;
+#ifdef FPU_LAZY
+static enum fpu_mode fpu_mode = FPU_MODE_LAZY;
+#else
+static enum fpu_mode fpu_mode = FPU_MODE_EAGER;
+#endif
+
+void fpu_set_mode(enum fpu_mode mode)
+{
+	fpu_mode = mode;
+}
+
+enum fpu_mode fpu_get_mode(void)
+{
+	return fpu_mode;
+}
+
+const char *fpu_save_name(void)
+{
+	return fpu_save_insn_names[save_insn];
+}
 
 int fpu_state_size(void)
 {
@@ -40,20 +76,69 @@ int fpu_state_size(void)
 
 void fpu_state_setup(void *state)
 {
+	struct xsave_area *xsave = state;
+
 	BUG_ON((uintptr_t)state & 0x3f);
 	memset(state, 0, state_size);
+
+	/* xrstors faults on the standard format */
+	if (save_insn == FPU_XSAVES)
+		xsave->xsave_hdr.xcomp_bv = XCOMP_BV_COMPACT | xcr0_features;
+}
+
+void *fpu_state_alloc(void)
+{
+	void *state = mem_alloc(state_size);
+
+	if (state)
+		fpu_state_setup(state);
+	return state;
 }
 
+void fpu_state_free(void *state)
+{
+	mem_free(state);
+}
+
+/* While CR0.TS is set any fpu instruction raises #NM. */
+void fpu_enable(void)
+{
+	__asm__ volatile ("clts");
+}
+
+void fpu_disable(void)
+{
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+/* xsaveopt and xsaves skip components that are in the init state or
+ * weren't modified since the last restore from the same area. */
 void fpu_state_save(void *state)
 {
 	const unsigned long edx = xcr0_features >> 32;
 	const unsigned long eax = xcr0_features & 0xfffffffful;
 	struct xsave_area *xsave = state;
 
-	__asm__ volatile ("xsave %0"
-				:
-				: "m"(*xsave), "d"(edx), "a"(eax)
-				: "memory");
+	switch (save_insn) {
+	case FPU_XSAVES:
+		__asm__ volatile ("xsaves %0"
+					:
+					: "m"(*xsave), "d"(edx), "a"(eax)
+					: "memory");
+		break;
+	case FPU_XSAVEOPT:
+		__asm__ volatile ("xsaveopt %0"
+					:
+					: "m"(*xsave), "d"(edx), "a"(eax)
+					: "memory");
+		break;
+	default:
+		__asm__ volatile ("xsave %0"
+					:
+					: "m"(*xsave), "d"(edx), "a"(eax)
+					: "memory");
+		break;
+	}
 }
 
 void fpu_state_restore(const void *state)
@@ -62,6 +147,14 @@ void fpu_state_restore(const void *state)
 	const unsigned long eax = xcr0_features & 0xfffffffful;
 	const struct xsave_area *xsave = state;
 
+	if (save_insn == FPU_XSAVES) {
+		__asm__ volatile ("xrstors %0"
+					:
+					: "m"(*xsave), "d"(edx), "a"(eax)
+					: "memory");
+		return;
+	}
+
 	__asm__ volatile ("xrstor %0"
 				:
 				: "m"(*xsave), "d"(edx), "a"(eax)
@@ -90,6 +183,15 @@ static void fpu_enumerate_features(void)
 	eax = 0x0d; ecx = 0;
 	cpuid(&eax, &ebx, &ecx, &edx);
 	xcr0_features = XSAVE_MASK(eax | ((unsigned long long)edx << 32));
+
+	eax = 0x0d; ecx = 1;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	if (eax & CPUID_XSAVES)
+		save_insn = FPU_XSAVES;
+	else if (eax & CPUID_XSAVEOPT)
+		save_insn = FPU_XSAVEOPT;
+	else
+		save_insn = FPU_XSAVE;
 }
 
 static void fpu_enable_xsave(void)
@@ -100,6 +202,10 @@ static void fpu_enable_xsave(void)
 	write_cr0((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP);
 	write_cr4(cr4 | CR4_OSXSAVE | CR4_OSXMMEXCPT | CR4_OSFXSR);
 	__xcr0_write(xcr0_features);
+	/* we don't use supervisor components, xsaves is only for the
+	 * compacted format and the modified optimization */
+	if (save_insn == FPU_XSAVES)
+		write_msr(IA32_XSS, 0);
 	__asm__ volatile ("fninit");
 }
 
@@ -10,7 +10,7 @@
 #define HASH_LOAD	2
 
 struct hash_bucket {
-	struct rwlock lock;
+	struct brlock lock;
 	struct hash_node guard;
 };
 
@@ -99,9 +99,10 @@ static uint64_t hash_key(uint64_t hash)
 	return hash_rev64(hash) | 1;
 }
 
-static void hash_bucket_setup(struct hash_bucket *bucket)
+static void hash_bucket_setup(struct hash_bucket *bucket,
+			struct brlock_readers *readers)
 {
-	rwlock_init(&bucket->lock);
+	brlock_init(&bucket->lock, readers);
 	list_init(&bucket->guard.ll);
 	bucket->guard.key = 0;
 }
@@ -111,8 +112,8 @@ static int hash_bucket_uninitialized(struct hash_bucket *bucket)
 	return list_empty(&bucket->guard.ll);
 }
 
-static struct hash_bucket *__hash_bucket(struct hash_table_impl *impl,
-			size_t bucket_no)
+static struct hash_bucket *__hash_bucket(struct hash_table *table,
+			struct hash_table_impl *impl, size_t bucket_no)
 {
 	const size_t seg = bucket_no / HASH_BUCKETS;
 	const size_t off = bucket_no % HASH_BUCKETS;
@@ -127,7 +128,7 @@ static struct hash_bucket *__hash_bucket(struct hash_table_impl *impl,
 		return 0;
 
 	for (size_t i = 0; i != HASH_BUCKETS; ++i)
-		hash_bucket_setup(&new->bucket[i]);
+		hash_bucket_setup(&new->bucket[i], &table->readers);
 
 	if (atomic_compare_exchange_strong_explicit(&impl->seg[seg], &old, new,
 				memory_order_release, memory_order_consume))
@@ -181,7 +182,7 @@ static struct hash_bucket *hash_bucket(struct hash_table *table, uint64_t hash)
 	impl = atomic_load_explicit(&table->table, memory_order_consume);
 	BUG_ON(!impl);
 	bucket_no = hash & (impl->buckets - 1);
-	bucket = __hash_bucket(impl, bucket_no);
+	bucket = __hash_bucket(table, impl, bucket_no);
 	rcu_read_unlock();
 
 	if (!bucket)
@@ -196,15 +197,15 @@ static struct hash_bucket *hash_bucket(struct hash_table *table, uint64_t hash)
 	if (!parent)
 		return 0;
 
-	const unsigned long flags = write_lock_save(&parent->lock);
+	const unsigned long flags = br_write_lock_save(&parent->lock);
 
-	write_lock(&bucket->lock);
+	br_write_lock(&bucket->lock);
 	if (hash_bucket_uninitialized(bucket)) {
 		bucket->guard.key = hash_bucket_key(bucket_no);
 		__hash_bucket_insert(parent, &bucket->guard);
 	}
-	write_unlock(&bucket->lock);
-	write_unlock_restore(&parent->lock, flags);
+	br_write_unlock(&bucket->lock);
+	br_write_unlock_restore(&parent->lock, flags);
 	return bucket;
 }
 
@@ -270,6 +271,7 @@ static void hash_grow(struct hash_table *table)
 
 void hash_setup(struct hash_table *table)
 {
+	brlock_readers_init(&table->readers);
 	atomic_store_explicit(&table->table, 0, memory_order_relaxed);
 	atomic_store_explicit(&table->entries, 0, memory_order_relaxed);
 	atomic_flag_clear_explicit(&table->resizing, memory_order_relaxed);
@@ -307,7 +309,7 @@ struct hash_node *hash_insert(struct hash_table *table, uint64_t hash,
 
 	new->key = hash_key(hash);
 
-	const unsigned long flags = write_lock_save(&bucket->lock);
+	const unsigned long flags = br_write_lock_save(&bucket->lock);
 	const uint64_t minkey = bucket->guard.key;
 	struct list_head *head = &bucket->guard.ll;
 	struct list_head *ptr = head->next;
@@ -332,7 +334,7 @@ struct hash_node *hash_insert(struct hash_table *table, uint64_t hash,
 		ptr = ptr->next;
 	}
 
-	write_unlock_restore(&bucket->lock, flags);
+	br_write_unlock_restore(&bucket->lock, flags);
 	hash_grow(table);
 	return new;
 }
@@ -347,7 +349,7 @@ struct hash_node *hash_remove(struct hash_table *table, uint64_t hash,
 
 	const uint64_t target = hash_key(hash);
 
-	const unsigned long flags = write_lock_save(&bucket->lock);
+	const unsigned long flags = br_write_lock_save(&bucket->lock);
 	const uint64_t minkey = bucket->guard.key;
 	struct list_head *head = &bucket->guard.ll;
 	struct list_head *ptr = head->next;
@@ -370,7 +372,7 @@ struct hash_node *hash_remove(struct hash_table *table, uint64_t hash,
 
 		ptr = ptr->next;
 	}
-	write_unlock_restore(&bucket->lock, flags);
+	br_write_unlock_restore(&bucket->lock, flags);
 	return res;
 }
 
@@ -384,7 +386,7 @@ struct hash_node *hash_lookup(struct hash_table *table, uint64_t hash,
 
 	const uint64_t target = hash_key(hash);
 
-	const unsigned long flags = read_lock_save(&bucket->lock);
+	const unsigned long flags = br_read_lock_save(&bucket->lock);
 	const uint64_t minkey = bucket->guard.key;
 	struct list_head *head = &bucket->guard.ll;
 	struct list_head *ptr = head->next;
@@ -404,6 +406,6 @@ struct hash_node *hash_lookup(struct hash_table *table, uint64_t hash,
 
 		ptr = ptr->next;
 	}
-	read_unlock_restore(&bucket->lock, flags);
+	br_read_unlock_restore(&bucket->lock, flags);
 	return res;
 }
@@ -34,12 +34,11 @@ static void hp_setup_rlist(struct hp_rlist *rlist)
 static int hp_rlist_add(struct hp_rlist *rlist, struct hp_deleted *deleted)
 {
 	if (rlist->size == rlist->capacity) {
-		const int old_order = rlist->order;
-		const int new_order = old_order + 1;
+		const int new_order = rlist->order + 1;
 		const size_t new_size = (size_t)1 << (PAGE_SHIFT + new_order);
 
 		struct hp_deleted *deleted =
-			(struct hp_deleted *)page_alloc(new_order, PA_ANY);
+			(struct hp_deleted *)mem_alloc(new_size);
 
 		if (!deleted)
 			return -1;
@@ -47,7 +46,7 @@ static int hp_rlist_add(struct hp_rlist *rlist, struct hp_deleted *deleted)
 		if (rlist->deleted) {
 			memcpy(deleted, rlist->deleted,
 					rlist->size * sizeof(*deleted));
-			page_free((uintptr_t)rlist->deleted, old_order);
+			mem_free(rlist->deleted);
 		}
 		rlist->capacity = new_size / sizeof(*deleted);
 		rlist->deleted = deleted;
@@ -84,12 +83,11 @@ static void hp_setup_plist(struct hp_plist *plist)
 static int hp_plist_add(struct hp_plist *plist, struct hp_protected *protected)
 {
 	if (plist->size == plist->capacity) {
-		const int old_order = plist->order;
-		const int new_order = old_order + 1;
+		const int new_order = plist->order + 1;
 		const size_t new_size = (size_t)1 << (PAGE_SHIFT + new_order);
 
 		struct hp_protected *protected =
-			(struct hp_protected *)page_alloc(new_order, PA_ANY);
+			(struct hp_protected *)mem_alloc(new_size);
 
 		if (!protected)
 			return -1;
@@ -97,7 +95,7 @@ static int hp_plist_add(struct hp_plist *plist, struct hp_protected *protected)
 		if (plist->protected) {
 			memcpy(protected, plist->protected,
 					plist->size * sizeof(*protected));
-			page_free((uintptr_t)plist->protected, old_order);
+			mem_free(plist->protected);
 		}
 		plist->capacity = new_size / sizeof(*protected);
 		plist->protected = protected;
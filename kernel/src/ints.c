@@ -17,6 +17,7 @@
 #define IDT_TRAP_GATE	IDT_TYPE(0xfu)
 
 #define IDT_PRESENT	(1u << 15)
+#define IDT_IST(x)	((unsigned)(x) & 0x7u)
 #define IDT_EXCEPTION	(IDT_KERNEL_MODE | IDT_INT_GATE | IDT_PRESENT)
 #define IDT_IRQ		(IDT_KERNEL_MODE | IDT_INT_GATE | IDT_PRESENT)
 
@@ -47,9 +48,20 @@ static void exception_handle(struct frame *frame)
 
 	struct thread *thread = thread_current();
 
+	if (frame->num == INT_PAGE_FAULT) {
+		const uintptr_t addr = read_cr2();
+
+		printf("Page fault at 0x%lx\n", (unsigned long)addr);
+		if (thread && thread_stack_overflow(thread, addr))
+			printf("Stack overflow in thread %p, stack 0x%lx-0x%lx\n",
+						thread,
+						(unsigned long)thread->stack_addr,
+						(unsigned long)(thread->stack_addr +
+							thread->stack_size));
+	}
+
 	if (thread) {
-		const int order = thread->stack_order + PAGE_SHIFT;
-		const uintptr_t size = 1ul << order;
+		const uintptr_t size = thread->stack_size;
 		const uintptr_t begin = thread->stack_addr;
 		const uintptr_t end = begin + size;
 
@@ -151,7 +163,13 @@ void ints_early_setup(void)
 	for (int i = IDT_EXC_BEGIN; i != IDT_EXC_END; ++i) {
 		const uintptr_t handler = (uintptr_t)int_raw_handler_table[i];
 
-		idt_desc_set(&idt[i], KERNEL_CS, handler, IDT_EXCEPTION);
+		unsigned flags = IDT_EXCEPTION;
+
+		if (i == INT_DOUBLE_FAULT)
+			flags |= IDT_IST(INT_DOUBLE_FAULT_IST);
+		if (i == INT_PAGE_FAULT)
+			flags |= IDT_IST(INT_EXCEPTION_IST);
+		idt_desc_set(&idt[i], KERNEL_CS, handler, flags);
 	}
 
 	for (int i = IDT_IRQ_BEGIN; i != IDT_IRQ_END; ++i) {
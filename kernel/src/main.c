@@ -1,4 +1,5 @@
 #include <scheduler.h>
+#include <string.h>
 #include <hashtable.h>
 #include <uart8250.h>
 #include <smpboot.h>
@@ -8,13 +9,19 @@
 #include <thread.h>
 #include <paging.h>
 #include <hazptr.h>
+#include <semaphore.h>
+#include <mutex.h>
+#include <rwsem.h>
 #include <debug.h>
+#include <fpu.h>
 #include <alloc.h>
 #include <time.h>
 #include <acpi.h>
 #include <apic.h>
 #include <ints.h>
 #include <cpu.h>
+#include <vmem.h>
+#include <numa.h>
 #include <rcu.h>
 #include <vmx.h>
 
@@ -50,10 +57,11 @@ static int ht_int_equal(const struct hash_node *node, const void *key)
 	return l->value == r->value;
 }
 
+static struct hash_table ht;
+
 static void __test_hashtable(void *unused)
 {
 	struct mem_cache cache;
-	struct hash_table ht;
 	int i, j;
 
 	(void) unused;
@@ -99,32 +107,1174 @@ static void test_hashtable(void)
 	printf("finished hashtable test\n");
 }
 
+#define TEST_RECLAIM_OBJS	2048
+
+static struct mem_cache test_reclaim_cache;
+static void *test_reclaim_obj[TEST_RECLAIM_OBJS];
+
+static void test_reclaim_fill(struct mem_cache *cache)
+{
+	for (int i = 0; i != TEST_RECLAIM_OBJS; ++i) {
+		test_reclaim_obj[i] = mem_cache_alloc(cache, PA_ANY);
+		BUG_ON(!test_reclaim_obj[i]);
+	}
+	for (int i = 0; i != TEST_RECLAIM_OBJS; ++i)
+		mem_cache_free(cache, test_reclaim_obj[i]);
+}
+
+static void __test_mem_reclaim(void *unused)
+{
+	struct mem_cache *cache = &test_reclaim_cache;
+	struct mem_reclaim_stats before, after;
+
+	(void) unused;
+
+	mem_cache_setup(cache, 128, 64);
+
+	/* the shrinker gives back every free pool */
+	test_reclaim_fill(cache);
+	mem_reclaim_stats(&before);
+	shrink_memory(~0ul);
+	mem_reclaim_stats(&after);
+	BUG_ON(after.shrink_pages == before.shrink_pages);
+	BUG_ON(cache->free_count > cache->reserve);
+
+	/* the reclaim thread trims the cache down to its reserve */
+	test_reclaim_fill(cache);
+	mem_reclaim_stats(&before);
+	do {
+		schedule();
+		mem_reclaim_stats(&after);
+	} while (after.reclaim_runs < before.reclaim_runs + 2);
+	BUG_ON(after.reclaim_pages == before.reclaim_pages);
+	BUG_ON(cache->free_count > cache->reserve);
+
+	mem_cache_release(cache);
+}
+
+static void test_mem_reclaim(void)
+{
+	struct thread *thread = thread_create(&__test_mem_reclaim, 0);
+
+	printf("start mem reclaim test\n");
+	thread_activate(thread);
+	thread_join(thread);
+	thread_destroy(thread);
+	printf("finished mem reclaim test\n");
+}
+
+#define TEST_FAIR_PERIOD	200
+
+static unsigned long long test_fair_end;
+
+static void __test_fair(void *unused)
+{
+	(void) unused;
+
+	while (current_time() < test_fair_end)
+		cpu_relax();
+}
+
+/* Every cpu gets two spinning threads pinned to it, one at nice 0 and one
+ * at nice 5, which is about a third of the nice 0 weight, so the nice 0
+ * ones must get at least twice as much cpu time. */
+static void test_fair(void)
+{
+	struct thread *threads[2 * MAX_CPU_NR];
+	const int count = 2 * cpu_count();
+	unsigned long long runtime[2] = { 0, 0 };
+
+	printf("start fair scheduling test\n");
+	test_fair_end = current_time() + TEST_FAIR_PERIOD;
+	for (int i = 0; i != count; ++i) {
+		BUG_ON(!(threads[i] = thread_create(&__test_fair, 0)));
+		thread_set_nice(threads[i], (i % 2) * 5);
+		thread_set_affinity(threads[i], 1ul << (i / 2));
+		thread_activate(threads[i]);
+	}
+
+	for (int i = 0; i != count; ++i) {
+		thread_join(threads[i]);
+		runtime[i % 2] += thread_cpu_time(threads[i]);
+		thread_destroy(threads[i]);
+	}
+	printf("nice 0: %llu cycles, nice 5: %llu cycles\n",
+				runtime[0], runtime[1]);
+	BUG_ON(runtime[0] < 2 * runtime[1]);
+	printf("finished fair scheduling test\n");
+}
+
+#define TEST_JOIN_PERIOD	100
+#define TEST_JOIN_RATIO		100
+
+static struct thread *test_join_target;
+
+static void __test_join_target(void *unused)
+{
+	const unsigned long long end = current_time() + TEST_JOIN_PERIOD;
+
+	(void) unused;
+	while (current_time() < end)
+		cpu_relax();
+}
+
+static void __test_join(void *unused)
+{
+	(void) unused;
+	thread_join(test_join_target);
+}
+
+/* Joiners sleep until the target finishes, so all they spend is what it
+ * takes to block and to wake up. */
+static void test_join(void)
+{
+	struct thread *joiners[MAX_CPU_NR];
+	const int count = cpu_count();
+	unsigned long long joined = 0;
+
+	printf("start join test\n");
+	BUG_ON(!(test_join_target = thread_create(&__test_join_target, 0)));
+	for (int i = 0; i != count; ++i) {
+		BUG_ON(!(joiners[i] = thread_create(&__test_join, 0)));
+		thread_activate(joiners[i]);
+	}
+	thread_activate(test_join_target);
+
+	for (int i = 0; i != count; ++i)
+		thread_join(joiners[i]);
+
+	const unsigned long long target = thread_cpu_time(test_join_target);
+
+	/* a joiner that polls would burn about as much as the target */
+	for (int i = 0; i != count; ++i) {
+		const unsigned long long time = thread_cpu_time(joiners[i]);
+
+		BUG_ON(time > target / TEST_JOIN_RATIO);
+		joined += time;
+		thread_destroy(joiners[i]);
+	}
+	printf("target: %llu cycles, %d joiners: %llu cycles\n",
+				target, count, joined);
+	thread_destroy(test_join_target);
+	printf("finished join test\n");
+}
+
+#define TEST_AFFINITY_YIELDS	100
+
+/* Walks over all cpus pinning itself to one at a time, and checks that
+ * neither yields nor the other threads around move it elsewhere. */
+static void __test_affinity(void *unused)
+{
+	struct thread *self = thread_current();
+
+	(void) unused;
+	for (int cpu = 0; cpu != cpu_count(); ++cpu) {
+		thread_set_affinity(self, 1ul << cpu);
+		for (int i = 0; i != TEST_AFFINITY_YIELDS; ++i) {
+			BUG_ON(cpu_id() != cpu);
+			schedule();
+		}
+	}
+
+	thread_set_affinity(self, ~0ul);
+	thread_migrate(0);
+}
+
+static void test_affinity(void)
+{
+	struct thread *threads[MAX_CPU_NR];
+
+	printf("start affinity test\n");
+	for (int i = 0; i != cpu_count(); ++i) {
+		BUG_ON(!(threads[i] = thread_create(&__test_affinity, 0)));
+		thread_activate(threads[i]);
+	}
+
+	for (int i = 0; i != cpu_count(); ++i) {
+		thread_join(threads[i]);
+		thread_destroy(threads[i]);
+	}
+	printf("finished affinity test\n");
+}
+
+#define TEST_STACK_PAGES	16
+#define TEST_STACK_DEPTH	40
+
+/* The whole recursion takes about 10 times more than the default stack
+ * size. */
+static __attribute__((noinline)) int __test_stack_recurse(int depth)
+{
+	volatile char buf[960];
+
+	for (size_t i = 0; i != sizeof(buf); ++i)
+		buf[i] = depth;
+	if (!depth)
+		return buf[0];
+	return __test_stack_recurse(depth - 1) + buf[sizeof(buf) - 1];
+}
+
+static void __test_stack(void *arg)
+{
+	struct thread *self = thread_current();
+	const uintptr_t guard = self->stack_addr - 1;
+
+	BUG_ON(!thread_stack_overflow(self, guard));
+	BUG_ON(thread_stack_overflow(self, self->stack_addr));
+	*(int *)arg = __test_stack_recurse(TEST_STACK_DEPTH);
+}
+
+static void test_stack(void)
+{
+	int res = -1;
+	struct thread *thread;
+
+	printf("start stack test\n");
+	thread = __thread_create(&__test_stack, &res,
+				TEST_STACK_PAGES * PAGE_SIZE);
+	BUG_ON(!thread || !vmem_addr((void *)thread->stack_addr));
+	thread_activate(thread);
+	thread_join(thread);
+	BUG_ON(res != TEST_STACK_DEPTH * (TEST_STACK_DEPTH + 1) / 2);
+	thread_destroy(thread);
+	printf("finished stack test\n");
+}
+
+#define TEST_SEMAPHORE_TIMEOUT		10
+#define TEST_SEMAPHORE_ITERATIONS	10000
+
+static struct semaphore test_semaphore_done;
+static struct rw_semaphore test_rwsem;
+static unsigned long test_rwsem_data[2];
+
+/* Odd threads write and even threads read, readers must never see a
+ * writer half way through. */
+static void __test_semaphore(void *arg)
+{
+	const int writer = (int)(uintptr_t)arg & 1;
+
+	for (int i = 0; i != TEST_SEMAPHORE_ITERATIONS; ++i) {
+		if (writer) {
+			rwsem_down_write(&test_rwsem);
+			++test_rwsem_data[0];
+			schedule();
+			++test_rwsem_data[1];
+			rwsem_up_write(&test_rwsem);
+		} else {
+			rwsem_down_read(&test_rwsem);
+			BUG_ON(test_rwsem_data[0] != test_rwsem_data[1]);
+			rwsem_up_read(&test_rwsem);
+		}
+	}
+	semaphore_up(&test_semaphore_done, 1);
+}
+
+static void test_semaphore(void)
+{
+	struct thread *threads[MAX_CPU_NR];
+	const int count = cpu_count();
+	unsigned long long start;
+	int writers = 0;
+
+	printf("start semaphore test\n");
+	semaphore_init(&test_semaphore_done, 0);
+	rwsem_init(&test_rwsem);
+
+	start = current_time();
+	BUG_ON(!semaphore_down_timeout(&test_semaphore_done, 1,
+				TEST_SEMAPHORE_TIMEOUT));
+	BUG_ON(current_time() - start < TEST_SEMAPHORE_TIMEOUT);
+
+	for (int i = 0; i != count; ++i) {
+		BUG_ON(!(threads[i] = thread_create(&__test_semaphore,
+					(void *)(uintptr_t)i)));
+		writers += i & 1;
+		thread_activate(threads[i]);
+	}
+
+	/* a single request for all units, it's granted only once every
+	 * thread is done */
+	semaphore_down(&test_semaphore_done, count);
+	BUG_ON(semaphore_trydown(&test_semaphore_done, 1));
+	BUG_ON(test_rwsem_data[0] != test_rwsem_data[1]);
+	BUG_ON(test_rwsem_data[0] !=
+			(unsigned long)writers * TEST_SEMAPHORE_ITERATIONS);
+
+	for (int i = 0; i != count; ++i) {
+		thread_join(threads[i]);
+		thread_destroy(threads[i]);
+	}
+	printf("finished semaphore test\n");
+}
+
+#define TEST_RW_ITERATIONS	10000
+
+/* Writers always bump both words together, so a reader that sees them
+ * differ has run concurrently with a writer. */
+struct test_rw_pair {
+	volatile unsigned long first;
+	volatile unsigned long second;
+};
+
+static struct brlock_readers test_br_readers;
+static struct brlock test_br;
+static struct test_rw_pair test_br_pair;
+static struct seqlock test_seq;
+static struct test_rw_pair test_seq_pair;
+
+static void __test_brlock(void *writer)
+{
+	for (int i = 0; i != TEST_RW_ITERATIONS; ++i) {
+		if (writer) {
+			br_write_lock(&test_br);
+			++test_br_pair.first;
+			++test_br_pair.second;
+			br_write_unlock(&test_br);
+			continue;
+		}
+
+		const unsigned long flags = br_read_lock_save(&test_br);
+		const unsigned long first = test_br_pair.first;
+		const unsigned long second = test_br_pair.second;
+
+		br_read_unlock_restore(&test_br, flags);
+		BUG_ON(first != second);
+	}
+}
+
+static void __test_seqlock(void *writer)
+{
+	for (int i = 0; i != TEST_RW_ITERATIONS; ++i) {
+		if (writer) {
+			write_seqlock(&test_seq);
+			++test_seq_pair.first;
+			++test_seq_pair.second;
+			write_sequnlock(&test_seq);
+			continue;
+		}
+
+		unsigned long first, second;
+		unsigned seq;
+
+		do {
+			seq = read_seqbegin(&test_seq);
+			first = test_seq_pair.first;
+			second = test_seq_pair.second;
+		} while (read_seqretry(&test_seq, seq));
+		BUG_ON(first != second);
+	}
+}
+
+/* A reader and a writer per cpu, every writer update must survive. */
+static void test_rw_run(thread_fptr_t fptr, struct test_rw_pair *pair)
+{
+	struct thread *threads[2 * MAX_CPU_NR];
+	const int count = 2 * cpu_count();
+
+	pair->first = pair->second = 0;
+	for (int i = 0; i != count; ++i) {
+		BUG_ON(!(threads[i] = thread_create(fptr,
+					(void *)(uintptr_t)(i % 2))));
+		thread_activate(threads[i]);
+	}
+	for (int i = 0; i != count; ++i) {
+		thread_join(threads[i]);
+		thread_destroy(threads[i]);
+	}
+	BUG_ON(pair->first != (unsigned long)cpu_count() * TEST_RW_ITERATIONS);
+	BUG_ON(pair->second != pair->first);
+}
+
+static void test_read_locks(void)
+{
+	printf("start brlock and seqlock test\n");
+	brlock_readers_init(&test_br_readers);
+	brlock_init(&test_br, &test_br_readers);
+	test_rw_run(&__test_brlock, &test_br_pair);
+	seqlock_init(&test_seq);
+	test_rw_run(&__test_seqlock, &test_seq_pair);
+	printf("finished brlock and seqlock test\n");
+}
+
+#ifdef BENCH
+#define BENCH_PAGE_ZONES	64
+#define BENCH_PAGE_SHIFT	15
+#define BENCH_PAGE_HOLE		0xff
+
+struct bench_page_zone {
+	struct list_head ll;
+	uintptr_t begin;
+	uintptr_t end;
+};
+
+static struct bench_page_zone bench_page_zone[BENCH_PAGE_ZONES];
+static uint8_t bench_page_section[2 * BENCH_PAGE_ZONES];
+static LIST_HEAD(bench_page_zones);
+
+/* Zone i covers section 2 * i, so zones zones leave zones - 1 holes. */
+static void bench_page_layout(int zones)
+{
+	list_init(&bench_page_zones);
+	memset(bench_page_section, BENCH_PAGE_HOLE,
+				sizeof(bench_page_section));
+	for (int i = 0; i != zones; ++i) {
+		struct bench_page_zone *zone = &bench_page_zone[i];
+
+		zone->begin = (uintptr_t)(2 * i) << BENCH_PAGE_SHIFT;
+		zone->end = zone->begin + ((uintptr_t)1 << BENCH_PAGE_SHIFT);
+		bench_page_section[2 * i] = i;
+		list_add_tail(&zone->ll, &bench_page_zones);
+	}
+}
+
+/* The lookup addr_page did before the section table. */
+static struct bench_page_zone *bench_page_list(uintptr_t idx)
+{
+	struct list_head *head = &bench_page_zones;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct bench_page_zone *zone = LIST_ENTRY(ptr,
+					struct bench_page_zone, ll);
+
+		if (idx >= zone->begin && idx < zone->end)
+			return zone;
+	}
+	return 0;
+}
+
+static struct bench_page_zone *bench_page_table(uintptr_t idx)
+{
+	const int id = bench_page_section[idx >> BENCH_PAGE_SHIFT];
+
+	if (id == BENCH_PAGE_HOLE)
+		return 0;
+	return &bench_page_zone[id];
+}
+
+static unsigned long long bench_page_run(int zones,
+			struct bench_page_zone *(*lookup)(uintptr_t))
+{
+	const int iterations = 100000;
+	const uintptr_t mask = ((uintptr_t)1 << BENCH_PAGE_SHIFT) - 1;
+	const unsigned long long start = rdtsc();
+
+	for (int i = 0; i != iterations; ++i) {
+		const int id = i & (zones - 1);
+		const uintptr_t idx = ((uintptr_t)(2 * id) << BENCH_PAGE_SHIFT)
+					+ (i & mask);
+
+		BUG_ON(lookup(idx) != &bench_page_zone[id]);
+	}
+	return (rdtsc() - start) / iterations;
+}
+
+static void bench_page_lookup(void)
+{
+	printf("start page lookup benchmark\n");
+	for (int zones = 1; zones <= BENCH_PAGE_ZONES; zones *= 2) {
+		bench_page_layout(zones);
+
+		const unsigned long long table = bench_page_run(zones,
+					&bench_page_table);
+		const unsigned long long list = bench_page_run(zones,
+					&bench_page_list);
+
+		printf("%d holes: table %llu, list %llu cycles per lookup\n",
+					zones - 1, table, list);
+	}
+	printf("finished page lookup benchmark\n");
+}
+
+#define BENCH_TICKS_PERIOD	500
+
+static volatile int bench_ticks_expired;
+
+static void bench_ticks_done(struct timer *timer)
+{
+	(void) timer;
+	bench_ticks_expired = 1;
+}
+
+static void __bench_ticks(const char *mode)
+{
+	unsigned long ticks[MAX_CPU_NR];
+	struct timer timer;
+
+	for (int i = 0; i != cpu_count(); ++i)
+		ticks[i] = time_cpu_ticks(i);
+
+	bench_ticks_expired = 0;
+	timer_setup(&timer, &bench_ticks_done);
+	timer_add(&timer, current_time() + BENCH_TICKS_PERIOD);
+	while (!bench_ticks_expired)
+		cpu_relax();
+
+	for (int i = 0; i != cpu_count(); ++i)
+		printf("cpu %d: %lu ticks per second, %s\n", i,
+					(time_cpu_ticks(i) - ticks[i]) *
+					1000 / (BENCH_TICKS_PERIOD * TIMER_TICK),
+					mode);
+}
+
+static void bench_ticks(void)
+{
+	printf("start tick rate benchmark\n");
+	time_set_tickless(0);
+	__bench_ticks("periodic");
+	time_set_tickless(1);
+	__bench_ticks("tickless");
+	printf("finished tick rate benchmark\n");
+}
+
+#define BENCH_SWITCH_ITERATIONS	10000
+
+static struct thread *bench_switch_threads[2];
+static int bench_switch_fpu;
+
+/* Two threads on the same cpu wake each other up and block, so every
+ * iteration is a context switch. */
+static void __bench_switch(void *arg)
+{
+	struct thread *self = thread_current();
+	struct thread *peer = bench_switch_threads[arg ? 0 : 1];
+
+	for (int i = 0; i != BENCH_SWITCH_ITERATIONS; ++i) {
+		const unsigned long flags = local_int_save();
+
+		if (bench_switch_fpu)
+			__asm__ volatile ("fld1\n\tfstp %%st(0)\n\t"
+						"pxor %%xmm0, %%xmm0" : : : "memory");
+		thread_set_state(self, THREAD_BLOCKED);
+		thread_wake(peer);
+		schedule();
+		local_int_restore(flags);
+	}
+	thread_wake(peer);
+}
+
+static void __bench_switch_mode(enum fpu_mode mode, int use_fpu)
+{
+	const unsigned long affinity = 1ul << cpu_id();
+
+	fpu_set_mode(mode);
+	bench_switch_fpu = use_fpu;
+	for (int i = 0; i != 2; ++i) {
+		bench_switch_threads[i] = thread_create(&__bench_switch,
+					(void *)(uintptr_t)i);
+		BUG_ON(!bench_switch_threads[i]);
+		thread_set_affinity(bench_switch_threads[i], affinity);
+	}
+
+	const unsigned long long start = rdtsc();
+
+	thread_activate(bench_switch_threads[0]);
+	for (int i = 0; i != 2; ++i)
+		thread_join(bench_switch_threads[i]);
+
+	const unsigned long long cycles = rdtsc() - start;
+
+	for (int i = 0; i != 2; ++i)
+		thread_destroy(bench_switch_threads[i]);
+
+	printf("%s, %s: %llu cycles per switch\n",
+				mode == FPU_MODE_LAZY ? "lazy" : "eager",
+				use_fpu ? "fpu" : "no fpu",
+				cycles / (2 * BENCH_SWITCH_ITERATIONS));
+}
+
+static void bench_switch(void)
+{
+	const enum fpu_mode mode = fpu_get_mode();
+
+	printf("start context switch benchmark (%s)\n", fpu_save_name());
+	__bench_switch_mode(FPU_MODE_EAGER, 0);
+	__bench_switch_mode(FPU_MODE_EAGER, 1);
+	__bench_switch_mode(FPU_MODE_LAZY, 0);
+	__bench_switch_mode(FPU_MODE_LAZY, 1);
+	fpu_set_mode(mode);
+	printf("finished context switch benchmark\n");
+}
+
+#define BENCH_CPUS_PERIOD	200
+
+struct bench_cpus_count {
+	unsigned long count;
+} __attribute__((aligned (64)));
+
+/* Runs fptr on each of the first cpus cpus, pinned to its own, until
+ * *stop is set BENCH_CPUS_PERIOD ticks later. Each worker stores what it
+ * has done in the unsigned long its argument points to. Returns the sum
+ * of those and the time it took in *ms. */
+static unsigned long long bench_cpus(int cpus, void (*fptr)(void *),
+			volatile int *stop, unsigned long long *ms)
+{
+	struct bench_cpus_count count[MAX_CPU_NR];
+	struct thread *threads[MAX_CPU_NR];
+	unsigned long long total = 0;
+
+	*stop = 0;
+	for (int i = 0; i != cpus; ++i) {
+		BUG_ON(!(threads[i] = thread_create(fptr, &count[i].count)));
+		thread_set_affinity(threads[i], 1ul << i);
+		thread_activate(threads[i]);
+	}
+
+	const unsigned long long start = current_time();
+
+	time_sleep(BENCH_CPUS_PERIOD);
+	*stop = 1;
+	*ms = (current_time() - start) * TIMER_TICK;
+
+	for (int i = 0; i != cpus; ++i) {
+		thread_join(threads[i]);
+		thread_destroy(threads[i]);
+		total += count[i].count;
+	}
+	return total;
+}
+
+static struct spinlock bench_lock;
+static unsigned long bench_lock_shared;
+static volatile int bench_lock_stop;
+
+static void __bench_lock(void *arg)
+{
+	unsigned long *count = arg;
+	unsigned long acquired = 0;
+
+	while (!bench_lock_stop) {
+		spin_lock(&bench_lock);
+		++bench_lock_shared;
+		spin_unlock(&bench_lock);
+		++acquired;
+	}
+	*count = acquired;
+}
+
+/* Every cpu takes and releases the same lock in a loop, the critical
+ * section touches shared data like real users do. */
+static void __bench_lock_cpus(int cpus)
+{
+	unsigned long long ms, total;
+
+	spin_lock_init(&bench_lock);
+	bench_lock_shared = 0;
+	total = bench_cpus(cpus, &__bench_lock, &bench_lock_stop, &ms);
+	BUG_ON(total != bench_lock_shared);
+
+	printf("%d cpus: %llu acquisitions per second\n", cpus,
+				total * 1000 / ms);
+}
+
+static void bench_spinlock(void)
+{
+	printf("start spinlock contention benchmark\n");
+	for (int cpus = 1; cpus <= cpu_count(); ++cpus)
+		__bench_lock_cpus(cpus);
+	printf("finished spinlock contention benchmark\n");
+}
+
+#define BENCH_HASH_KEYS		1024
+#define BENCH_HASH_HOT		16
+
+static struct hash_table bench_hash;
+static struct ht_int bench_hash_nodes[BENCH_HASH_KEYS];
+static volatile int bench_hash_stop;
+
+/* All cpus look up the same few keys, so they hit the same buckets. */
+static void __bench_hash(void *arg)
+{
+	unsigned long *count = arg;
+	unsigned long lookups = 0;
+
+	while (!bench_hash_stop) {
+		struct ht_int key;
+
+		key.value = lookups % BENCH_HASH_HOT;
+		BUG_ON(hash_lookup(&bench_hash, (uint64_t)key.value, &key,
+					&ht_int_equal) !=
+					&bench_hash_nodes[key.value].hn);
+		++lookups;
+	}
+	*count = lookups;
+}
+
+static void __bench_hash_cpus(int cpus)
+{
+	unsigned long long ms;
+	const unsigned long long total = bench_cpus(cpus, &__bench_hash,
+				&bench_hash_stop, &ms);
+
+	printf("%d cpus: %llu lookups per second\n", cpus, total * 1000 / ms);
+}
+
+static void bench_hash_lookup(void)
+{
+	printf("start hash lookup benchmark\n");
+	hash_setup(&bench_hash);
+	for (int i = 0; i != BENCH_HASH_KEYS; ++i) {
+		struct hash_node *node = &bench_hash_nodes[i].hn;
+
+		bench_hash_nodes[i].value = i;
+		BUG_ON(hash_insert(&bench_hash, (uint64_t)i, node,
+					&ht_int_equal) != node);
+	}
+
+	for (int cpus = 1; cpus <= cpu_count(); ++cpus)
+		__bench_hash_cpus(cpus);
+
+	for (int i = 0; i != BENCH_HASH_KEYS; ++i) {
+		struct hash_node *node = &bench_hash_nodes[i].hn;
+		struct ht_int key;
+
+		key.value = i;
+		BUG_ON(hash_remove(&bench_hash, (uint64_t)i, &key,
+					&ht_int_equal) != node);
+	}
+	hash_release(&bench_hash);
+	printf("finished hash lookup benchmark\n");
+}
+
+static struct mutex bench_mutex;
+static unsigned long bench_mutex_shared;
+static volatile int bench_mutex_stop;
+
+static void __bench_mutex(void *arg)
+{
+	unsigned long *count = arg;
+	unsigned long acquired = 0;
+
+	while (!bench_mutex_stop) {
+		mutex_lock(&bench_mutex);
+		++bench_mutex_shared;
+		mutex_unlock(&bench_mutex);
+		++acquired;
+	}
+	*count = acquired;
+}
+
+static void __bench_mutex_cpus(int cpus, int spinning)
+{
+	unsigned long long ms, total;
+
+	mutex_init(&bench_mutex);
+	mutex_set_spinning(spinning);
+	bench_mutex_shared = 0;
+	total = bench_cpus(cpus, &__bench_mutex, &bench_mutex_stop, &ms);
+	BUG_ON(total != bench_mutex_shared);
+
+	printf("%d cpus, %s: %llu acquisitions per second\n", cpus,
+				spinning ? "spinning" : "blocking",
+				total * 1000 / ms);
+}
+
+/* Blocking mode is how the mutex behaved before it learned to spin. */
+static void bench_mutex_lock(void)
+{
+	printf("start mutex benchmark\n");
+	for (int cpus = 1; cpus <= cpu_count(); ++cpus) {
+		__bench_mutex_cpus(cpus, 0);
+		__bench_mutex_cpus(cpus, 1);
+	}
+	mutex_set_spinning(1);
+	printf("finished mutex benchmark\n");
+}
+
+#define BENCH_WAKEUP_ITERATIONS	100
+
+static struct thread *bench_wakeup_thread;
+static struct timer bench_wakeup_timer;
+static volatile unsigned long long bench_wakeup_tsc;
+static volatile int bench_wakeup_done;
+
+struct bench_wakeup_stats {
+	unsigned long long total;
+	unsigned long long max;
+};
+
+static void bench_wakeup_fire(struct timer *timer)
+{
+	(void) timer;
+	bench_wakeup_tsc = rdtsc();
+	thread_wake(bench_wakeup_thread);
+}
+
+/* Sleeps until the timer wakes it up from the interrupt handler and
+ * measures how long it took to get the cpu after that. */
+static void __bench_wakeup(void *arg)
+{
+	struct bench_wakeup_stats *stats = arg;
+	struct thread *self = thread_current();
+
+	for (int i = 0; i != BENCH_WAKEUP_ITERATIONS; ++i) {
+		const unsigned long flags = local_int_save();
+
+		thread_set_state(self, THREAD_BLOCKED);
+		timer_add(&bench_wakeup_timer, current_time() + 1);
+		schedule();
+		local_int_restore(flags);
+
+		const unsigned long long cycles = rdtsc() - bench_wakeup_tsc;
+
+		stats->total += cycles;
+		if (cycles > stats->max)
+			stats->max = cycles;
+	}
+}
+
+static void bench_wakeup_load(void *unused)
+{
+	(void) unused;
+
+	while (!bench_wakeup_done)
+		cpu_relax();
+}
+
+static void __bench_wakeup_policy(int policy, const char *name)
+{
+	struct thread *load[MAX_CPU_NR];
+	struct bench_wakeup_stats stats = { 0, 0 };
+
+	bench_wakeup_done = 0;
+	for (int i = 0; i != cpu_count(); ++i) {
+		BUG_ON(!(load[i] = thread_create(&bench_wakeup_load, 0)));
+		thread_activate(load[i]);
+	}
+
+	timer_setup(&bench_wakeup_timer, &bench_wakeup_fire);
+	BUG_ON(!(bench_wakeup_thread = thread_create(&__bench_wakeup,
+				&stats)));
+	thread_set_policy(bench_wakeup_thread, policy,
+				policy == THREAD_FAIR ? 0 : THREAD_RT_PRIOS / 2);
+	thread_activate(bench_wakeup_thread);
+	thread_join(bench_wakeup_thread);
+	thread_destroy(bench_wakeup_thread);
+
+	bench_wakeup_done = 1;
+	for (int i = 0; i != cpu_count(); ++i) {
+		thread_join(load[i]);
+		thread_destroy(load[i]);
+	}
+
+	printf("%s: %llu avg, %llu max wakeup cycles\n", name,
+				stats.total / BENCH_WAKEUP_ITERATIONS,
+				stats.max);
+}
+
+static void bench_wakeup(void)
+{
+	printf("start wakeup latency benchmark\n");
+	__bench_wakeup_policy(THREAD_FAIR, "fair");
+	__bench_wakeup_policy(THREAD_FIFO, "fifo");
+	printf("finished wakeup latency benchmark\n");
+}
+
+#define BENCH_THREADS_ITERATIONS	1000
+
+static void bench_threads_nop(void *unused)
+{
+	(void) unused;
+}
+
+/* Each thread is destroyed before the next one is created, so all but
+ * the first one come from the thread pool. */
+static void bench_threads(void)
+{
+	printf("start thread create/join/destroy benchmark\n");
+
+	const unsigned long long start = rdtsc();
+
+	for (int i = 0; i != BENCH_THREADS_ITERATIONS; ++i) {
+		struct thread *thread = thread_create(&bench_threads_nop, 0);
+
+		BUG_ON(!thread);
+		thread_activate(thread);
+		thread_join(thread);
+		thread_destroy(thread);
+	}
+
+	const unsigned long long cycles = rdtsc() - start;
+
+	printf("%llu cycles per thread\n", cycles / BENCH_THREADS_ITERATIONS);
+	printf("finished thread create/join/destroy benchmark\n");
+}
+#endif /*BENCH*/
+
+static void test_vmem(void)
+{
+	const size_t size = (size_t)1 << 22;
+	unsigned long *ptr = vmem_alloc(size);
+
+	printf("start vmem test\n");
+	BUG_ON(!ptr || !vmem_addr(ptr) || vmem_size(ptr) != size);
+	for (size_t i = 0; i != size / sizeof(*ptr); ++i)
+		ptr[i] = i;
+	for (size_t i = 0; i != size / sizeof(*ptr); ++i)
+		BUG_ON(ptr[i] != i);
+	vmem_free(ptr);
+	printf("finished vmem test\n");
+}
+
+/* The unused tail of the buddy block must be back on the free lists as
+ * maximal aligned blocks. */
+static void test_alloc_pages_tail(struct page *page, size_t pages)
+{
+	size_t size = 1;
+
+	while (size < pages)
+		size <<= 1;
+
+	for (size_t i = pages; i != size;) {
+		int order = 0;
+
+		while (!(i & ((size_t)1 << order))
+				&& i + ((size_t)2 << order) <= size)
+			++order;
+		BUG_ON(page_free_order(page + i) != order);
+		i += (size_t)1 << order;
+	}
+}
+
+static void test_alloc_pages(void)
+{
+	static const size_t pages[] = {3, 5, 9, 17, 33};
+	const int count = sizeof(pages) / sizeof(pages[0]);
+	struct page *page[sizeof(pages) / sizeof(pages[0])];
+
+	printf("start exact page allocation test\n");
+	for (int round = 0; round != 100; ++round) {
+		for (int i = 0; i != count; ++i) {
+			BUG_ON(!(page[i] = __page_alloc_pages(pages[i], PA_ANY)));
+			memset((void *)page_addr(page[i]), 0xff,
+						pages[i] << PAGE_SHIFT);
+			test_alloc_pages_tail(page[i], pages[i]);
+		}
+		for (int i = 0; i != count; ++i)
+			__page_free_pages(page[i], pages[i]);
+	}
+	printf("finished exact page allocation test\n");
+}
+
+#define BOOT_PHASES	32
+#define BOOT_PHASE(setup)	do { setup; boot_phase(#setup); } while (0)
+
+struct boot_phase {
+	const char *name;
+	unsigned long long cycles;
+};
+
+static struct boot_phase boot_phases[BOOT_PHASES];
+static int boot_phases_count;
+static unsigned long long boot_phase_start;
+
+/* uart isn't ready at the beginning, so we record and print later */
+static void boot_phase(const char *name)
+{
+	const unsigned long long now = rdtsc();
+
+	BUG_ON(boot_phases_count == BOOT_PHASES);
+	boot_phases[boot_phases_count].name = name;
+	boot_phases[boot_phases_count].cycles = now - boot_phase_start;
+	++boot_phases_count;
+	boot_phase_start = now;
+}
+
+static void boot_phase_dump(void)
+{
+	unsigned long long total = 0;
+
+	printf("boot phases:\n");
+	for (int i = 0; i != boot_phases_count; ++i) {
+		printf("    %s: %llu cycles\n", boot_phases[i].name,
+					boot_phases[i].cycles);
+		total += boot_phases[i].cycles;
+	}
+	printf("    total: %llu cycles\n", total);
+}
+
+static int test_numa_has_memory(int node)
+{
+	struct list_head *head = &page_alloc_zones;
+
+	for (struct list_head *ptr = head->next; ptr != head; ptr = ptr->next) {
+		const struct page_alloc_zone *zone = LIST_ENTRY(ptr,
+					struct page_alloc_zone, ll);
+
+		if (zone->node == node)
+			return 1;
+	}
+	return 0;
+}
+
+/* Every node prefers itself, then nodes in the order of distance, and the
+ * allocator takes pages from the first of them that has memory. */
+static void test_numa(void)
+{
+	const int nodes = numa_nodes();
+
+	printf("start numa test\n");
+	BUG_ON(numa_node_order(0)[0] != 0);
+	for (int node = 0; node != nodes; ++node) {
+		const int *order = numa_node_order(node);
+		int expect = -1;
+
+		BUG_ON(order[0] != node);
+		for (int i = 1; i != nodes; ++i) {
+			BUG_ON(numa_distance(node, order[i - 1]) >
+						numa_distance(node, order[i]));
+		}
+		for (int i = 0; i != nodes && expect < 0; ++i) {
+			if (test_numa_has_memory(order[i]))
+				expect = order[i];
+		}
+
+		struct page *page = __page_alloc_node(0, PA_ANY, node);
+
+		BUG_ON(!page);
+		BUG_ON(page_node(page) != expect);
+		__page_free(page, 0);
+	}
+	printf("finished numa test\n");
+}
+
+#define TEST_STEAL_THREADS	2
+#define TEST_STEAL_PERIOD	500
+
+struct test_steal_thread {
+	unsigned long long max_wait;
+} __attribute__((aligned (64)));
+
+static volatile unsigned long long test_steal_start;
+static volatile int test_steal_stop;
+
+/* A gap between two consecutive reads of the time is the time the thread
+ * spent waiting in a run queue. */
+static void test_steal_spin(void *arg)
+{
+	struct test_steal_thread *self = arg;
+	unsigned long long prev = test_steal_start;
+
+	while (!test_steal_stop) {
+		const unsigned long long now = current_time();
+
+		if (now - prev > self->max_wait)
+			self->max_wait = now - prev;
+		prev = now;
+	}
+}
+
+static unsigned long test_steal_success(void)
+{
+	unsigned long success = 0;
+
+	for (int cpu = 0; cpu != cpu_count(); ++cpu) {
+		struct scheduler_stats stats;
+
+		scheduler_stats(cpu, &stats);
+		success += stats.steal_success;
+	}
+	return success;
+}
+
+/* All threads start in the run queue of this cpu, so the other cpus have
+ * to steal them, and every thread should get the cpu about once in
+ * runnable / cpus slices. */
+static void test_steal(void)
+{
+	static struct test_steal_thread arg[TEST_STEAL_THREADS * MAX_CPU_NR];
+	static struct thread *threads[TEST_STEAL_THREADS * MAX_CPU_NR];
+	const int cpus = cpu_count();
+	const int count = TEST_STEAL_THREADS * cpus;
+	/* main and the reclaim thread stay runnable as well */
+	const unsigned long long limit = 2 * SCHEDULER_SLICE *
+				((count + 2 + cpus - 1) / cpus + 1);
+	const unsigned long before = test_steal_success();
+	unsigned long long max_wait = 0;
+
+	printf("start work stealing test\n");
+	test_steal_stop = 0;
+	test_steal_start = current_time();
+	for (int i = 0; i != count; ++i) {
+		arg[i].max_wait = 0;
+		BUG_ON(!(threads[i] = thread_create(&test_steal_spin, &arg[i])));
+		thread_activate(threads[i]);
+	}
+
+	while (current_time() < test_steal_start + TEST_STEAL_PERIOD)
+		schedule();
+	test_steal_stop = 1;
+
+	for (int i = 0; i != count; ++i) {
+		thread_join(threads[i]);
+		thread_destroy(threads[i]);
+		if (arg[i].max_wait > max_wait)
+			max_wait = arg[i].max_wait;
+	}
+
+	const unsigned long steals = test_steal_success() - before;
+
+	printf("%lu steals, longest wait %llu ticks\n", steals, max_wait);
+	BUG_ON(cpus > 1 && !steals);
+	BUG_ON(max_wait > limit);
+	printf("finished work stealing test\n");
+}
+
 void main(const struct mboot_info *info)
 {
 	gdb_hang();
-	uart8250_setup();
-	ints_early_setup();
-	acpi_early_setup();
-
-	apic_setup();
-	balloc_setup(info);
-	percpu_setup();
-	page_alloc_setup();
-	mem_alloc_setup();
-	hp_setup();
-	rcu_setup();
-	threads_setup();
-
-	paging_setup();
-	time_setup();
-	scheduler_setup();
-	smp_setup();
-
-	cpu_setup();
+	boot_phase_start = rdtsc();
+	BOOT_PHASE(uart8250_setup());
+	BOOT_PHASE(cpu_early_setup());
+	BOOT_PHASE(ints_early_setup());
+	BOOT_PHASE(acpi_early_setup());
+
+	BOOT_PHASE(apic_setup());
+	BOOT_PHASE(numa_setup());
+	BOOT_PHASE(balloc_setup(info));
+	BOOT_PHASE(percpu_setup());
+	BOOT_PHASE(page_alloc_setup());
+	BOOT_PHASE(mem_alloc_setup());
+	BOOT_PHASE(hp_setup());
+	BOOT_PHASE(rcu_setup());
+	BOOT_PHASE(threads_setup());
+
+	BOOT_PHASE(paging_setup());
+	BOOT_PHASE(vmem_setup());
+	BOOT_PHASE(time_setup());
+	BOOT_PHASE(scheduler_setup());
+	BOOT_PHASE(smp_setup());
+
+	BOOT_PHASE(cpu_setup());
+	BOOT_PHASE(mem_reclaim_setup());
+	boot_phase_dump();
 
 	//vmx_setup();
 
 	test_hashtable();
+	test_mem_reclaim();
+	test_vmem();
+	test_alloc_pages();
+	test_numa();
+	test_steal();
+	test_fair();
+	test_join();
+	test_affinity();
+	test_stack();
+	test_read_locks();
+	test_semaphore();
+	page_cache_dump();
+	mem_alloc_dump();
+	scheduler_dump();
+#ifdef BENCH
+	bench_page_lookup();
+	bench_ticks();
+	bench_wakeup();
+	bench_threads();
+	bench_switch();
+	bench_spinlock();
+	bench_hash_lookup();
+	bench_mutex_lock();
+#endif
+	lockstat_dump();
 
 	while (1);
 }
@@ -1,20 +1,45 @@
 #include <memory.h>
 #include <string.h>
 #include <balloc.h>
+#include <bitops.h>
 #include <debug.h>
+#include <numa.h>
 
 #define PAGE_FREE_OFFS	8
 #define PAGE_FREE_MASK	(1ul << PAGE_FREE_OFFS)
 #define PAGE_ORDER_MASK	(PAGE_FREE_MASK - 1)
 #define PAGE_USER_OFFS	16
+#define PAGE_ZONE_OFFS	56
 #define MEMORY_RANGES	(sizeof(memory_range)/sizeof(memory_range[0]))
 
+#define SECTION_SHIFT	15
+#define SECTION_PAGES	((uintptr_t)1 << SECTION_SHIFT)
+#define SECTION_MASK	(SECTION_PAGES - 1)
+#define MAX_ZONES	255
+
 struct memory_range {
 	uintptr_t begin;
 	uintptr_t end;
 	unsigned long flags;
 };
 
+/* Per cpu cache refills with batch pages when it runs empty and gives
+ * pages back to the buddy allocator when it grows above high watermark
+ * until only low pages left. */
+struct page_cache_limits {
+	int low;
+	int high;
+	int batch;
+};
+
+/* Every section covers SECTION_PAGES page frames. Usually a section
+ * belongs to a single zone, but when a zone boundary falls inside a section
+ * we keep a zone id for every page frame of that section. */
+struct mem_section {
+	uint8_t *zone_map;
+	int zone;
+};
+
 static const struct memory_range memory_range[] = {
 	{0, LOW_MEMORY, PA_LOW},
 	{LOW_MEMORY, NORMAL_MEMORY, PA_NORMAL},
@@ -22,8 +47,29 @@ static const struct memory_range memory_range[] = {
 	{HIGH_MEMORY, UNMAPPED_MEMORY, PA_UNMAPPED}
 };
 
+static struct page_cache_limits page_cache_limits[PAGE_CACHE_ORDERS] = {
+	{16, 64, 16},
+	{8, 32, 8},
+	{4, 16, 4},
+	{2, 8, 2}
+};
+
 struct list_head page_alloc_zones;
 
+static struct spinlock shrinkers_lock;
+static struct list_head shrinkers;
+
+struct page_numa_stats {
+	atomic_ulong local;
+	atomic_ulong remote;
+};
+
+static struct page_numa_stats page_numa_stats[MAX_CPU_NR];
+static struct page_alloc_zone *zone_table[MAX_ZONES + 1];
+static int zones;
+static struct mem_section *mem_section;
+static size_t mem_sections;
+
 static inline int page_order(const struct page *page)
 {
 	return page->flags & PAGE_ORDER_MASK;
@@ -68,7 +114,7 @@ int page_test_bit(const struct page *page, int bit)
 }
 
 static void __page_alloc_zone_setup(uintptr_t zbegin, uintptr_t zend,
-			unsigned long flags)
+			unsigned long flags, int node)
 {
 	const uintptr_t page_mask = ~((uintptr_t)PAGE_MASK);
 	const uintptr_t begin_addr = (zbegin + PAGE_SIZE - 1) & page_mask;
@@ -83,21 +129,44 @@ static void __page_alloc_zone_setup(uintptr_t zbegin, uintptr_t zend,
 	const size_t size = sizeof(struct page_alloc_zone)
 				+ sizeof(struct page) * pages;
 	struct page_alloc_zone *zone = (struct page_alloc_zone *)
-				__balloc_alloc(size, PAGE_SIZE,
-					/* from = */BOOTSTRAP_BEGIN,
-					/* to = */BOOTSTRAP_END);
+				numa_balloc_alloc(size, PAGE_SIZE, node);
 
 	BUG_ON((uintptr_t)zone == BOOTSTRAP_END);
 
-	printf("page alloc zone [0x%llx; 0x%llx]\n", (unsigned long long)begin,
-				(unsigned long long)end);
-	memset(zone->pages, 0, sizeof(struct page) * (zone->end - zone->end));
+	BUG_ON(zones == MAX_ZONES);
+
+	printf("page alloc zone [0x%llx; 0x%llx] node %d\n",
+				(unsigned long long)begin,
+				(unsigned long long)end, node);
 	zone->flags = flags;
+	zone->node = node;
 	zone->begin = begin;
 	zone->end = end;
+	zone->id = ++zones;
+	zone_table[zone->id] = zone;
 
-	for (int i = 0; i != MAX_ORDER + 1; ++i)
+	const struct page init = {
+		.flags = (unsigned long)zone->id << PAGE_ZONE_OFFS
+	};
+
+	for (size_t i = 0; i != pages; ++i)
+		zone->pages[i] = init;
+
+	for (int i = 0; i != MAX_ORDER + 1; ++i) {
 		list_init(&zone->order[i]);
+		zone->blocks[i] = 0;
+	}
+
+	for (int i = 0; i != MAX_CPU_NR; ++i) {
+		struct page_cache *cache = &zone->cache[i];
+
+		spin_lock_init(&cache->lock);
+		for (int order = 0; order != PAGE_CACHE_ORDERS; ++order) {
+			list_init(&cache->pages[order]);
+			cache->count[order] = 0;
+		}
+		cache->hits = cache->misses = 0;
+	}
 	spin_lock_init(&zone->lock);
 	list_add_tail(&zone->ll, &page_alloc_zones);
 }
@@ -115,43 +184,107 @@ static void page_alloc_zone_setup(const struct memory_node *node)
 		const uintptr_t end = node->end < range->end ?
 					node->end : range->end;
 
-		__page_alloc_zone_setup(begin, end, range->flags);
+		/* zone never crosses numa node boundary */
+		for (uintptr_t addr = begin; addr < end;) {
+			uintptr_t node_end;
+			const int nid = numa_addr_node(addr, &node_end);
+			const uintptr_t zend = node_end < end ? node_end : end;
+
+			__page_alloc_zone_setup(addr, zend, range->flags, nid);
+			addr = zend;
+		}
 	}
 }
 
-static struct page_alloc_zone *page_alloc_zone_find(uintptr_t idx)
+static void page_section_fill(uint8_t *map, uintptr_t sbegin,
+			const struct page_alloc_zone *zone)
 {
-	struct list_head *head = &page_alloc_zones;
-	struct list_head *ptr;
+	const uintptr_t send = sbegin + SECTION_PAGES;
+	const uintptr_t begin = zone->begin > sbegin ? zone->begin : sbegin;
+	const uintptr_t end = zone->end < send ? zone->end : send;
 
-	for (ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
-					struct page_alloc_zone, ll);
+	memset(map + (begin - sbegin), zone->id, end - begin);
+}
 
-		if (idx >= zone->begin && idx < zone->end)
-			return zone;
+static void page_section_add(struct mem_section *section, uintptr_t sbegin,
+			const struct page_alloc_zone *zone)
+{
+	if (!section->zone_map && !section->zone) {
+		section->zone = zone->id;
+		return;
 	}
 
-	return 0;
+	if (!section->zone_map) {
+		uint8_t *map = (uint8_t *)__balloc_alloc(SECTION_PAGES,
+					PAGE_SIZE,
+					/* from = */BOOTSTRAP_BEGIN,
+					/* to = */BOOTSTRAP_END);
+
+		BUG_ON((uintptr_t)map == BOOTSTRAP_END);
+		memset(map, 0, SECTION_PAGES);
+		page_section_fill(map, sbegin, zone_table[section->zone]);
+		section->zone_map = map;
+		section->zone = 0;
+	}
+	page_section_fill(section->zone_map, sbegin, zone);
 }
 
-static struct page_alloc_zone *page_zone(const struct page *page)
+static void page_section_setup(void)
 {
-	struct list_head *head = &page_alloc_zones;
-	struct list_head *ptr;
+	const uintptr_t pages = phys_mem_limit() >> PAGE_SHIFT;
+	const size_t sections = (pages + SECTION_PAGES - 1) >> SECTION_SHIFT;
+	const size_t size = sizeof(*mem_section) * sections;
+
+	mem_section = (struct mem_section *)__balloc_alloc(size, PAGE_SIZE,
+				/* from = */BOOTSTRAP_BEGIN,
+				/* to = */BOOTSTRAP_END);
+	BUG_ON((uintptr_t)mem_section == BOOTSTRAP_END);
+	memset(mem_section, 0, size);
+	mem_sections = sections;
+
+	for (int id = 1; id <= zones; ++id) {
+		const struct page_alloc_zone *zone = zone_table[id];
+		const uintptr_t first = zone->begin >> SECTION_SHIFT;
+		const uintptr_t last = (zone->end - 1) >> SECTION_SHIFT;
+
+		for (uintptr_t sec = first; sec <= last; ++sec)
+			page_section_add(&mem_section[sec],
+						sec << SECTION_SHIFT, zone);
+	}
+}
 
-	for (ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
-					struct page_alloc_zone, ll);
-		const size_t pages = zone->end - zone->begin;
+static struct page_alloc_zone *page_alloc_zone_find(uintptr_t idx)
+{
+	const uintptr_t sec = idx >> SECTION_SHIFT;
 
-		if ((size_t)(page - zone->pages) < pages)
-			return zone;
-	}
+	if (sec >= mem_sections)
+		return 0;
 
-	BUG("orphan page");
+	const struct mem_section *section = &mem_section[sec];
+	const int id = section->zone_map
+				? section->zone_map[idx & SECTION_MASK]
+				: section->zone;
+	struct page_alloc_zone *zone = zone_table[id];
 
-	return 0;
+	if (!zone || idx < zone->begin || idx >= zone->end)
+		return 0;
+	return zone;
+}
+
+static struct page_alloc_zone *page_zone(const struct page *page)
+{
+	const int id = page->flags >> PAGE_ZONE_OFFS;
+	struct page_alloc_zone *zone = zone_table[id];
+
+	if (!zone || (size_t)(page - zone->pages) >= zone->end - zone->begin)
+		BUG("orphan page");
+
+	return zone;
+}
+
+int page_node(const struct page *page)
+{
+	return page_zone(page)->node;
 }
 
 uintptr_t page_addr(const struct page *page)
@@ -164,20 +297,41 @@ uintptr_t page_addr(const struct page *page)
 struct page *addr_page(uintptr_t addr)
 {
 	const uintptr_t page = addr >> PAGE_SHIFT;
-	struct list_head *head = &page_alloc_zones;
-	struct list_head *ptr;
 
 	BUG_ON(addr & PAGE_MASK);
 
-	for (ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
-					struct page_alloc_zone, ll);
-		if (page < zone->begin || page >= zone->end)
-			continue;
-		return &zone->pages[page - zone->begin];
-	}
-	BUG("Page for addr 0x%lx not found\n", (unsigned long)addr);
-	return 0;
+	struct page_alloc_zone *zone = page_alloc_zone_find(page);
+
+	if (!zone)
+		BUG("Page for addr 0x%lx not found\n", (unsigned long)addr);
+	return &zone->pages[page - zone->begin];
+}
+
+/* order of the largest aligned block starting at idx and ending before end */
+static int page_range_order(uintptr_t idx, uintptr_t end)
+{
+	int order = bsr(end - idx);
+
+	if (idx && bsf(idx) < order)
+		order = bsf(idx);
+	return order < MAX_ORDER ? order : MAX_ORDER;
+}
+
+static void page_zone_add_block(struct page_alloc_zone *zone,
+			struct page *page, int order)
+{
+	list_add(&page->ll, &zone->order[order]);
+	++zone->blocks[order];
+	page_set_order(page, order);
+	page_set_free(page);
+}
+
+static void page_zone_del_block(struct page_alloc_zone *zone,
+			struct page *page, int order)
+{
+	list_del(&page->ll);
+	--zone->blocks[order];
+	page_set_busy(page);
 }
 
 static void __page_alloc_zone_free(uintptr_t zbegin, uintptr_t zend)
@@ -198,22 +352,11 @@ static void __page_alloc_zone_free(uintptr_t zbegin, uintptr_t zend)
 	BUG_ON(end <= zone->begin || end > zone->end);
 
 	for (uintptr_t page = begin; page != end;) {
-		int order;
-
-		for (order = 0; order < MAX_ORDER; ++order) {
-			if (page & (1ull << order))
-				break;
-			if (page + (1ull << (order + 1)) > end)
-				break;
-		}
-
-		const size_t pages = (size_t)1 << order;
-		struct page *ptr = &zone->pages[page - zone->begin];
+		const int order = page_range_order(page, end);
 
-		list_add_tail(&ptr->ll, &zone->order[order]);
-		page_set_order(ptr, order);
-		page_set_free(ptr);
-		page += pages;
+		page_zone_add_block(zone, &zone->pages[page - zone->begin],
+					order);
+		page += (uintptr_t)1 << order;
 	}
 }
 
@@ -236,14 +379,16 @@ static void page_alloc_zone_free(const struct memory_node *node)
 
 static void page_alloc_zone_dump(const struct page_alloc_zone *zone)
 {
-	printf("zone 0x%llx-0x%llx:\n",
+	printf("zone 0x%llx-0x%llx node %d:\n",
 				(unsigned long long)(zone->begin << PAGE_SHIFT),
-				(unsigned long long)(zone->end << PAGE_SHIFT));
+				(unsigned long long)(zone->end << PAGE_SHIFT),
+				zone->node);
 	for (int order = MAX_ORDER; order >= 0; --order) {
-		if (list_empty(&zone->order[order]))
+		const unsigned long count = zone->blocks[order];
+
+		if (!count)
 			continue;
 
-		const unsigned long count = list_size(&zone->order[order]);
 		const unsigned long block_size = (1ul << order) << PAGE_SHIFT;
 
 		printf("    %lu blocks of size %lu\n", count, block_size);
@@ -253,8 +398,11 @@ static void page_alloc_zone_dump(const struct page_alloc_zone *zone)
 void page_alloc_setup(void)
 {
 	struct rb_node *ptr = rb_leftmost(&memory_map);
+	const unsigned long long start = rdtsc();
 
 	list_init(&page_alloc_zones);
+	list_init(&shrinkers);
+	spin_lock_init(&shrinkers_lock);
 
 	while (ptr) {
 		const struct memory_node *node = RB2MEMORY_NODE(ptr);
@@ -263,6 +411,12 @@ void page_alloc_setup(void)
 		ptr = rb_next(ptr);
 	}
 
+	const unsigned long long zones_done = rdtsc();
+
+	page_section_setup();
+
+	const unsigned long long sections_done = rdtsc();
+
 	ptr = rb_leftmost(&free_ranges);
 
 	while (ptr) {
@@ -272,6 +426,7 @@ void page_alloc_setup(void)
 		ptr = rb_next(ptr);
 	}
 
+	const unsigned long long free_done = rdtsc();
 	struct list_head *head = &page_alloc_zones;
 
 	for (struct list_head *p = head->next; p != head; p = p->next) {
@@ -280,13 +435,18 @@ void page_alloc_setup(void)
 
 		page_alloc_zone_dump(zone);
 	}
+
+	printf("page alloc setup cycles: zones %llu, sections %llu, "
+				"free lists %llu, dump %llu\n",
+				zones_done - start, sections_done - zones_done,
+				free_done - sections_done, rdtsc() - free_done);
 }
 
 static struct page *__page_alloc_zone(struct page_alloc_zone *zone, int order)
 {
 	int current = order;
 
-	while (list_empty(&zone->order[current]) && current <= MAX_ORDER)
+	while (current <= MAX_ORDER && !zone->blocks[current])
 		++current;
 
 	if (current > MAX_ORDER)
@@ -298,24 +458,104 @@ static struct page *__page_alloc_zone(struct page_alloc_zone *zone, int order)
 				struct page, ll);
 	const uintptr_t idx = zone->begin + (page - zone->pages);
 
-	page_set_busy(page);
-	list_del(&page->ll);
+	page_zone_del_block(zone, page, current);
 
 	while (current != order) {
 		const uintptr_t bidx = idx ^ (1ull << --current);
 		struct page *buddy = zone->pages + (bidx - zone->begin);
 
-		list_add(&buddy->ll, &zone->order[current]);
+		page_zone_add_block(zone, buddy, current);
+	}
+
+	return page;
+}
+
+static void __page_free_zone(struct page_alloc_zone *zone, struct page *page,
+			int order);
+
+static void page_cache_refill(struct page_alloc_zone *zone,
+			struct page_cache *cache, int order)
+{
+	const int batch = page_cache_limits[order].batch;
+	struct list_head *head = &cache->pages[order];
+
+	spin_lock(&zone->lock);
+	for (int i = 0; i != batch; ++i) {
+		struct page *page = __page_alloc_zone(zone, order);
+
+		if (!page)
+			break;
+
+		/* refilled pages are cold, so put them at the tail */
+		list_add_tail(&page->ll, head);
+		++cache->count[order];
+	}
+	spin_unlock(&zone->lock);
+}
+
+static void page_cache_shrink(struct page_alloc_zone *zone,
+			struct page_cache *cache, int order, int count)
+{
+	struct list_head *head = &cache->pages[order];
+
+	spin_lock(&zone->lock);
+	while (cache->count[order] > count) {
+		struct page *page = LIST_ENTRY(head->prev, struct page, ll);
+
+		list_del(&page->ll);
+		--cache->count[order];
+		__page_free_zone(zone, page, order);
+	}
+	spin_unlock(&zone->lock);
+}
+
+static struct page *page_cache_alloc(struct page_alloc_zone *zone, int order)
+{
+	const unsigned long flags = local_int_save();
+	struct page_cache *cache = &zone->cache[cpu_id()];
+	struct list_head *head = &cache->pages[order];
+	struct page *page = 0;
+
+	spin_lock(&cache->lock);
+	if (list_empty(head)) {
+		++cache->misses;
+		page_cache_refill(zone, cache, order);
+	} else {
+		++cache->hits;
+	}
 
-		page_set_order(buddy, current);
-		page_set_free(buddy);
+	if (!list_empty(head)) {
+		page = LIST_ENTRY(list_first(head), struct page, ll);
+		list_del(&page->ll);
+		--cache->count[order];
 	}
+	spin_unlock(&cache->lock);
+	local_int_restore(flags);
 
 	return page;
 }
 
+static void page_cache_free(struct page_alloc_zone *zone, struct page *page,
+			int order)
+{
+	const unsigned long flags = local_int_save();
+	struct page_cache *cache = &zone->cache[cpu_id()];
+	const struct page_cache_limits *limits = &page_cache_limits[order];
+
+	/* freed page is likely hot, so put it at the head */
+	spin_lock(&cache->lock);
+	list_add(&page->ll, &cache->pages[order]);
+	if (++cache->count[order] > limits->high)
+		page_cache_shrink(zone, cache, order, limits->low);
+	spin_unlock(&cache->lock);
+	local_int_restore(flags);
+}
+
 static struct page *page_alloc_zone(struct page_alloc_zone *zone, int order)
 {
+	if (order < PAGE_CACHE_ORDERS)
+		return page_cache_alloc(zone, order);
+
 	const unsigned long flags = spin_lock_save(&zone->lock);
 	struct page *page = __page_alloc_zone(zone, order);
 
@@ -323,11 +563,9 @@ static struct page *page_alloc_zone(struct page_alloc_zone *zone, int order)
 	return page;
 }
 
-struct page *__page_alloc(int order, unsigned long flags)
+static struct page *page_alloc_node_try(int order, unsigned long flags,
+			int node, struct page_alloc_zone **pzone)
 {
-	if (order > MAX_ORDER)
-		return 0;
-
 	struct list_head *head = &page_alloc_zones;
 	struct list_head *ptr;
 
@@ -335,44 +573,93 @@ struct page *__page_alloc(int order, unsigned long flags)
 		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
 					struct page_alloc_zone, ll);
 
-		if ((zone->flags & flags) == 0ul)
+		if (zone->node != node || (zone->flags & flags) == 0ul)
 			continue;
 
 		struct page *page = page_alloc_zone(zone, order);
 
-		if (page)
+		if (page) {
+			*pzone = zone;
 			return page;
+		}
 	}
 
 	return 0;
 }
 
-uintptr_t page_alloc(int order, unsigned long flags)
+/* Go through nodes from the closest to the farthest one */
+static struct page *page_alloc_any_zone_try(int order, unsigned long flags,
+			int node, struct page_alloc_zone **pzone)
+{
+	const int *nodes = numa_node_order(node);
+
+	for (int i = 0; i != numa_nodes(); ++i) {
+		struct page *page = page_alloc_node_try(order, flags, nodes[i],
+					pzone);
+
+		if (!page)
+			continue;
+
+		struct page_numa_stats *stats = &page_numa_stats[cpu_id()];
+
+		if (i)
+			atomic_fetch_add_explicit(&stats->remote, 1,
+						memory_order_relaxed);
+		else
+			atomic_fetch_add_explicit(&stats->local, 1,
+						memory_order_relaxed);
+		return page;
+	}
+
+	return 0;
+}
+
+static struct page *page_alloc_any_zone(int order, unsigned long flags,
+			int node, struct page_alloc_zone **pzone)
 {
 	if (order > MAX_ORDER)
 		return 0;
 
-	struct list_head *head = &page_alloc_zones;
-	struct list_head *ptr;
+	struct page *page = page_alloc_any_zone_try(order, flags, node, pzone);
 
-	for (ptr = head->next; ptr != head; ptr = ptr->next) {
-		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
-					struct page_alloc_zone, ll);
+	if (page)
+		return page;
 
-		if ((zone->flags & flags) == 0ul)
-			continue;
+	/* pages sitting in the per cpu caches might be enough to build
+	 * a block of the requested order, so give them back and retry */
+	page_cache_drain();
+	if ((page = page_alloc_any_zone_try(order, flags, node, pzone)))
+		return page;
 
-		struct page *page = page_alloc_zone(zone, order);
+	if (!shrink_memory((unsigned long)1 << order))
+		return 0;
 
-		if (!page)
-			continue;
+	page_cache_drain();
+	return page_alloc_any_zone_try(order, flags, node, pzone);
+}
 
-		const uintptr_t index = zone->begin + (page - zone->pages);
+struct page *__page_alloc_node(int order, unsigned long flags, int node)
+{
+	struct page_alloc_zone *zone;
 
-		return index << PAGE_SHIFT;
-	}
+	return page_alloc_any_zone(order, flags, node, &zone);
+}
 
-	return 0;
+uintptr_t page_alloc_node(int order, unsigned long flags, int node)
+{
+	struct page *page = __page_alloc_node(order, flags, node);
+
+	return page ? page_addr(page) : 0;
+}
+
+struct page *__page_alloc(int order, unsigned long flags)
+{
+	return __page_alloc_node(order, flags, numa_node());
+}
+
+uintptr_t page_alloc(int order, unsigned long flags)
+{
+	return page_alloc_node(order, flags, numa_node());
 }
 
 static void __page_free_zone(struct page_alloc_zone *zone, struct page *page,
@@ -393,30 +680,114 @@ static void __page_free_zone(struct page_alloc_zone *zone, struct page *page,
 		if (!page_is_free(buddy) || page_order(buddy) != order)
 			break;
 
+		page_zone_del_block(zone, buddy, order);
 		if (bidx < idx) {
 			page = buddy;
 			idx = bidx;
 		}
-
-		list_del(&buddy->ll);
 		++order;
 	}
 
-	list_add(&page->ll, &zone->order[order]);
-
-	page_set_order(page, order);
-	page_set_free(page);
+	page_zone_add_block(zone, page, order);
 }
 
 static void page_free_zone(struct page_alloc_zone *zone, struct page *page,
 			int order)
 {
+	if (order < PAGE_CACHE_ORDERS) {
+		page_cache_free(zone, page, order);
+		return;
+	}
+
 	const unsigned long flags = spin_lock_save(&zone->lock);
 
 	__page_free_zone(zone, page, order);
 	spin_unlock_restore(&zone->lock, flags);
 }
 
+/* Page range [begin; end) is handled as a sequence of maximal aligned
+ * blocks, so freeing it piece by piece gives the same buddies we had. */
+static void __page_free_range(struct page_alloc_zone *zone, uintptr_t begin,
+			uintptr_t end)
+{
+	while (begin != end) {
+		const int order = page_range_order(begin, end);
+
+		__page_free_zone(zone, &zone->pages[begin - zone->begin], order);
+		begin += 1ull << order;
+	}
+}
+
+static int page_pages_order(size_t pages)
+{
+	return pages > 1 ? bsr(pages - 1) + 1 : 0;
+}
+
+static int page_pages_exact(size_t pages)
+{
+	return !(pages & (pages - 1));
+}
+
+struct page *__page_alloc_pages(size_t pages, unsigned long flags)
+{
+	if (!pages)
+		return 0;
+
+	const int order = page_pages_order(pages);
+	struct page_alloc_zone *zone;
+	struct page *page = page_alloc_any_zone(order, flags, numa_node(),
+				&zone);
+
+	if (!page || page_pages_exact(pages))
+		return page;
+
+	const uintptr_t idx = zone->begin + (page - zone->pages);
+	const uintptr_t end = idx + pages;
+	const unsigned long irqs = spin_lock_save(&zone->lock);
+
+	/* buddy checks look only at block heads, so heads of blocks we keep
+	 * must not carry stale free bits */
+	for (uintptr_t i = idx; i != end; i += 1ull << page_range_order(i, end))
+		page_set_busy(&zone->pages[i - zone->begin]);
+	__page_free_range(zone, end, idx + (1ull << order));
+	spin_unlock_restore(&zone->lock, irqs);
+
+	return page;
+}
+
+uintptr_t page_alloc_pages(size_t pages, unsigned long flags)
+{
+	struct page *page = __page_alloc_pages(pages, flags);
+
+	return page ? page_addr(page) : 0;
+}
+
+void __page_free_pages(struct page *page, size_t pages)
+{
+	if (!page || !pages)
+		return;
+
+	if (page_pages_exact(pages)) {
+		__page_free(page, page_pages_order(pages));
+		return;
+	}
+
+	struct page_alloc_zone *zone = page_zone(page);
+	const uintptr_t idx = zone->begin + (page - zone->pages);
+	const unsigned long flags = spin_lock_save(&zone->lock);
+
+	__page_free_range(zone, idx, idx + pages);
+	spin_unlock_restore(&zone->lock, flags);
+}
+
+void page_free_pages(uintptr_t addr, size_t pages)
+{
+	if (!addr)
+		return;
+
+	__page_free_pages(addr_page(addr), pages);
+}
+
 void page_free(uintptr_t addr, int order)
 {
 	if (!addr)
@@ -442,6 +813,30 @@ void __page_free(struct page *page, int order)
 	page_free_zone(zone, page, order);
 }
 
+/* Returns the order of the free list that holds page as a block head, or
+ * -1 if page doesn't start a free block. */
+int page_free_order(const struct page *page)
+{
+	struct page_alloc_zone *zone = page_zone(page);
+	const unsigned long flags = spin_lock_save(&zone->lock);
+	int order;
+
+	for (order = 0; order <= MAX_ORDER; ++order) {
+		struct list_head *head = &zone->order[order];
+		struct list_head *ptr;
+
+		for (ptr = head->next; ptr != head; ptr = ptr->next) {
+			if (ptr == &page->ll)
+				break;
+		}
+		if (ptr != head)
+			break;
+	}
+	spin_unlock_restore(&zone->lock, flags);
+
+	return order <= MAX_ORDER ? order : -1;
+}
+
 uintptr_t phys_mem_limit(void)
 {
 	uintptr_t limit = 0;
@@ -460,3 +855,114 @@ uintptr_t phys_mem_limit(void)
 
 	return limit;
 }
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	const unsigned long flags = spin_lock_save(&shrinkers_lock);
+
+	list_add_tail(&shrinker->ll, &shrinkers);
+	spin_unlock_restore(&shrinkers_lock, flags);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	const unsigned long flags = spin_lock_save(&shrinkers_lock);
+
+	list_del(&shrinker->ll);
+	spin_unlock_restore(&shrinkers_lock, flags);
+}
+
+unsigned long shrink_memory(unsigned long pages)
+{
+	const unsigned long flags = spin_lock_save(&shrinkers_lock);
+	struct list_head *head = &shrinkers;
+	unsigned long freed = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head && freed < pages;
+				ptr = ptr->next) {
+		struct shrinker *shrinker = LIST_ENTRY(ptr,
+					struct shrinker, ll);
+
+		freed += shrinker->shrink(shrinker, pages - freed);
+	}
+	spin_unlock_restore(&shrinkers_lock, flags);
+
+	return freed;
+}
+
+void page_cache_set_limits(int order, int low, int high, int batch)
+{
+	BUG_ON(order < 0 || order >= PAGE_CACHE_ORDERS);
+	BUG_ON(low < 0 || low > high || batch <= 0 || batch > high);
+
+	struct page_cache_limits *limits = &page_cache_limits[order];
+
+	limits->low = low;
+	limits->high = high;
+	limits->batch = batch;
+}
+
+void page_cache_stats(int cpu, struct page_cache_stats *stats)
+{
+	struct list_head *head = &page_alloc_zones;
+	struct list_head *ptr;
+
+	BUG_ON(cpu < 0 || cpu >= MAX_CPU_NR);
+	stats->hits = stats->misses = stats->pages = 0;
+
+	for (ptr = head->next; ptr != head; ptr = ptr->next) {
+		const struct page_alloc_zone *zone = CONTAINER_OF(ptr,
+					struct page_alloc_zone, ll);
+		const struct page_cache *cache = &zone->cache[cpu];
+
+		stats->hits += cache->hits;
+		stats->misses += cache->misses;
+		for (int order = 0; order != PAGE_CACHE_ORDERS; ++order)
+			stats->pages += (unsigned long)cache->count[order]
+						<< order;
+	}
+}
+
+/* Pages in caches of other cpus count as much as ours when we need a
+ * large block, so all caches are drained, each under its own lock. */
+void page_cache_drain(void)
+{
+	struct list_head *head = &page_alloc_zones;
+	struct list_head *ptr;
+
+	for (ptr = head->next; ptr != head; ptr = ptr->next) {
+		struct page_alloc_zone *zone = CONTAINER_OF(ptr,
+					struct page_alloc_zone, ll);
+
+		for (int cpu = 0; cpu != MAX_CPU_NR; ++cpu) {
+			struct page_cache *cache = &zone->cache[cpu];
+			const unsigned long flags = spin_lock_save(
+						&cache->lock);
+
+			for (int order = 0; order != PAGE_CACHE_ORDERS;
+						++order)
+				page_cache_shrink(zone, cache, order, 0);
+			spin_unlock_restore(&cache->lock, flags);
+		}
+	}
+}
+
+void page_cache_dump(void)
+{
+	for (int cpu = 0; cpu != cpu_count(); ++cpu) {
+		struct page_cache_stats stats;
+
+		page_cache_stats(cpu, &stats);
+		printf("cpu %d page cache: %lu hits, %lu misses, %lu pages\n",
+					cpu, stats.hits, stats.misses,
+					stats.pages);
+		printf("cpu %d node %d: %lu local, %lu remote allocations\n",
+					cpu, cpu_node(cpu),
+					atomic_load_explicit(
+						&page_numa_stats[cpu].local,
+						memory_order_relaxed),
+					atomic_load_explicit(
+						&page_numa_stats[cpu].remote,
+						memory_order_relaxed));
+	}
+}
@@ -1,58 +1,154 @@
 #include <scheduler.h>
 #include <thread.h>
 #include <mutex.h>
+#include <cpu.h>
 
 
-struct mutex_wait {
-	struct list_head ll;
-	struct thread *thread;
-};
+#define MUTEX_WAITERS	((uintptr_t)1)
+
+static int mutex_spinning = 1;
+
+
+static struct thread *mutex_owner(uintptr_t owner)
+{
+	return (struct thread *)(owner & ~MUTEX_WAITERS);
+}
 
 void mutex_init(struct mutex *mutex)
 {
-	spin_lock_init(&mutex->lock);
-	list_init(&mutex->wait_list);
-	mutex->owner = 0;
+	atomic_init(&mutex->owner, 0);
+	wait_queue_init(&mutex->wait);
 }
 
-void mutex_lock(struct mutex *mutex)
+void mutex_set_spinning(int enable)
+{
+	mutex_spinning = enable;
+}
+
+int mutex_trylock(struct mutex *mutex)
+{
+	uintptr_t owner = 0;
+
+	return atomic_compare_exchange_strong_explicit(&mutex->owner, &owner,
+				(uintptr_t)thread_current(),
+				memory_order_acquire, memory_order_relaxed);
+}
+
+/* Spin while the owner runs on another cpu, it'll likely release the
+ * mutex sooner than we could block and wake up. Once there are waiters
+ * the mutex goes to them and spinning makes no sense. Owner may exit
+ * and its thread be reused meanwhile, but thread structures are never
+ * unmapped and the owner word is checked again before it's trusted. */
+static int mutex_spin(struct mutex *mutex)
+{
+	const uintptr_t self = (uintptr_t)thread_current();
+	uintptr_t owner = atomic_load_explicit(&mutex->owner,
+				memory_order_relaxed);
+
+	while (1) {
+		if (!owner) {
+			if (atomic_compare_exchange_weak_explicit(
+						&mutex->owner, &owner, self,
+						memory_order_acquire,
+						memory_order_relaxed))
+				return 1;
+			continue;
+		}
+
+		if ((owner & MUTEX_WAITERS) ||
+					!thread_on_cpu(mutex_owner(owner)))
+			return 0;
+
+		cpu_relax();
+		owner = atomic_load_explicit(&mutex->owner,
+					memory_order_relaxed);
+	}
+}
+
+/* Unlock hands the mutex over to the first waiter, so waiters get it in
+ * FIFO order and a woken up waiter never has to retry. */
+static void mutex_lock_slow(struct mutex *mutex)
 {
 	struct thread *self = thread_current();
-	struct mutex_wait wait;
-
-	spin_lock(&mutex->lock);
-	if (mutex->owner) {
-		wait.thread = self;
-		list_add_tail(&wait.ll, &mutex->wait_list);
-		thread_set_state(self, THREAD_BLOCKED);
-	} else {
-		mutex->owner = self;
+	struct wait_queue *queue = &mutex->wait;
+	struct wait_entry wait;
+	unsigned long flags = spin_lock_save(&queue->lock);
+	uintptr_t owner = atomic_load_explicit(&mutex->owner,
+				memory_order_relaxed);
+
+	/* the waiters bit is set and cleared only under the queue lock */
+	while (1) {
+		if (!owner) {
+			if (atomic_compare_exchange_weak_explicit(
+						&mutex->owner, &owner,
+						(uintptr_t)self,
+						memory_order_acquire,
+						memory_order_relaxed)) {
+				spin_unlock_restore(&queue->lock, flags);
+				return;
+			}
+			continue;
+		}
+
+		if ((owner & MUTEX_WAITERS) ||
+			atomic_compare_exchange_weak_explicit(&mutex->owner,
+						&owner, owner | MUTEX_WAITERS,
+						memory_order_relaxed,
+						memory_order_relaxed))
+			break;
+	}
+
+	wait_entry_init(&wait);
+	while (mutex_owner(atomic_load_explicit(&mutex->owner,
+				memory_order_acquire)) != self) {
+		__wait_prepare(queue, &wait);
+		spin_unlock_restore(&queue->lock, flags);
+		schedule();
+		flags = spin_lock_save(&queue->lock);
 	}
-	spin_unlock(&mutex->lock);
+	__wait_finish(queue, &wait);
+	spin_unlock_restore(&queue->lock, flags);
+}
+
+void mutex_lock(struct mutex *mutex)
+{
+	if (mutex_trylock(mutex))
+		return;
 
-	if (mutex->owner == self)
+	if (mutex_spinning && mutex_spin(mutex))
 		return;
-	schedule();
+
+	mutex_lock_slow(mutex);
 }
 
-void mutex_unlock(struct mutex *mutex)
+static void mutex_unlock_slow(struct mutex *mutex)
 {
-	struct list_head *head;
-	struct list_head *next;
-
-	spin_lock(&mutex->lock);
-	head = &mutex->wait_list;
-	next = head->next;
-	if (next != head) {
-		struct mutex_wait *wait = CONTAINER_OF(next,
-					struct mutex_wait, ll);
-		struct thread *thread = wait->thread;
-
-		list_del(next);
-		mutex->owner = thread;
-		thread_activate(wait->thread);
-	} else {
-		mutex->owner = 0;
+	struct wait_queue *queue = &mutex->wait;
+	const unsigned long flags = spin_lock_save(&queue->lock);
+	struct list_head *head = &queue->waiters;
+	uintptr_t owner = 0;
+
+	if (!list_empty(head)) {
+		struct wait_entry *wait = LIST_ENTRY(list_first(head),
+					struct wait_entry, ll);
+
+		owner = (uintptr_t)wait->thread;
+		if (head->next->next != head)
+			owner |= MUTEX_WAITERS;
 	}
-	spin_unlock(&mutex->lock);
+
+	atomic_store_explicit(&mutex->owner, owner, memory_order_release);
+	__wait_wake(queue);
+	spin_unlock_restore(&queue->lock, flags);
+}
+
+void mutex_unlock(struct mutex *mutex)
+{
+	uintptr_t owner = (uintptr_t)thread_current();
+
+	if (atomic_compare_exchange_strong_explicit(&mutex->owner, &owner, 0,
+				memory_order_release, memory_order_relaxed))
+		return;
+
+	mutex_unlock_slow(mutex);
 }
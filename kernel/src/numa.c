@@ -0,0 +1,284 @@
+#include <memory.h>
+#include <balloc.h>
+#include <debug.h>
+#include <apic.h>
+#include <acpi.h>
+#include <numa.h>
+#include <cpu.h>
+
+
+#define MAX_NUMA_RANGES	32
+
+/* SRAT memory affinity entry translated to node id */
+struct numa_range {
+	uintptr_t begin;
+	uintptr_t end;
+	int node;
+};
+
+static struct numa_range numa_range[MAX_NUMA_RANGES];
+static int numa_ranges;
+
+/* node ids are dense, numa_pxm maps them back to proximity domains */
+static uint32_t numa_pxm[MAX_NODES];
+static int nodes = 1;
+
+static int numa_cpu[MAX_CPU_NR];
+static uint8_t numa_dist[MAX_NODES][MAX_NODES];
+static int numa_order[MAX_NODES][MAX_NODES];
+
+
+static int numa_pxm_node(uint32_t pxm)
+{
+	for (int i = 0; i != nodes; ++i) {
+		if (numa_pxm[i] == pxm)
+			return i;
+	}
+
+	if (nodes == MAX_NODES) {
+		printf("too many numa nodes, pxm %lu goes to node 0\n",
+					(unsigned long)pxm);
+		return 0;
+	}
+
+	numa_pxm[nodes] = pxm;
+	return nodes++;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t pxm)
+{
+	for (int i = 0; i != local_apics; ++i) {
+		if ((uint32_t)local_apic_ids[i] != apic_id)
+			continue;
+		numa_cpu[i] = numa_pxm_node(pxm);
+		return;
+	}
+}
+
+static void numa_add_memory(uint64_t begin, uint64_t size, uint32_t pxm)
+{
+	if (!size)
+		return;
+
+	if (numa_ranges == MAX_NUMA_RANGES) {
+		printf("too many numa memory ranges\n");
+		return;
+	}
+
+	struct numa_range *range = &numa_range[numa_ranges++];
+
+	range->begin = begin;
+	range->end = begin + size;
+	range->node = numa_pxm_node(pxm);
+}
+
+static int numa_parse_srat(void)
+{
+	ACPI_TABLE_HEADER *table;
+	ACPI_STATUS status = AcpiGetTable("SRAT", 1, &table);
+
+	if (ACPI_FAILURE(status))
+		return -1;
+
+	const ACPI_TABLE_SRAT *srat = (const ACPI_TABLE_SRAT *)table;
+	uintptr_t ptr = (uintptr_t)(srat + 1);
+	const uintptr_t end = (uintptr_t)srat + srat->Header.Length;
+
+	/* the first domain we see becomes node 0 */
+	nodes = 0;
+	while (ptr < end) {
+		const ACPI_SUBTABLE_HEADER *hdr =
+					(const ACPI_SUBTABLE_HEADER *)ptr;
+
+		if (!hdr->Length)
+			break;
+
+		switch (hdr->Type) {
+		case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+			const ACPI_SRAT_CPU_AFFINITY *cpu =
+					(const ACPI_SRAT_CPU_AFFINITY *)hdr;
+			const uint32_t pxm = cpu->ProximityDomainLo |
+					((uint32_t)cpu->ProximityDomainHi[0] << 8) |
+					((uint32_t)cpu->ProximityDomainHi[1] << 16) |
+					((uint32_t)cpu->ProximityDomainHi[2] << 24);
+
+			if (cpu->Flags & ACPI_SRAT_CPU_ENABLED)
+				numa_add_cpu(cpu->ApicId, pxm);
+			break;
+		}
+		case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+			const ACPI_SRAT_X2APIC_CPU_AFFINITY *cpu =
+				(const ACPI_SRAT_X2APIC_CPU_AFFINITY *)hdr;
+
+			if (cpu->Flags & ACPI_SRAT_CPU_ENABLED)
+				numa_add_cpu(cpu->ApicId, cpu->ProximityDomain);
+			break;
+		}
+		case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+			const ACPI_SRAT_MEM_AFFINITY *mem =
+					(const ACPI_SRAT_MEM_AFFINITY *)hdr;
+
+			if (mem->Flags & ACPI_SRAT_MEM_ENABLED)
+				numa_add_memory(mem->BaseAddress, mem->Length,
+							mem->ProximityDomain);
+			break;
+		}
+		}
+		ptr += hdr->Length;
+	}
+
+	if (!nodes)
+		nodes = 1;
+	return 0;
+}
+
+static void numa_parse_slit(void)
+{
+	for (int i = 0; i != nodes; ++i) {
+		for (int j = 0; j != nodes; ++j)
+			numa_dist[i][j] = i == j
+						? NUMA_LOCAL_DISTANCE
+						: NUMA_REMOTE_DISTANCE;
+	}
+
+	ACPI_TABLE_HEADER *table;
+	ACPI_STATUS status = AcpiGetTable("SLIT", 1, &table);
+
+	if (ACPI_FAILURE(status))
+		return;
+
+	const ACPI_TABLE_SLIT *slit = (const ACPI_TABLE_SLIT *)table;
+	const uint64_t count = slit->LocalityCount;
+
+	for (int i = 0; i != nodes; ++i) {
+		for (int j = 0; j != nodes; ++j) {
+			if (numa_pxm[i] >= count || numa_pxm[j] >= count)
+				continue;
+			numa_dist[i][j] =
+				slit->Entry[numa_pxm[i] * count + numa_pxm[j]];
+		}
+	}
+}
+
+static void numa_order_setup(void)
+{
+	for (int node = 0; node != nodes; ++node) {
+		int *order = numa_order[node];
+
+		/* insertion sort by distance, it's stable so the node itself
+		 * stays in front of other nodes with the same distance */
+		order[0] = node;
+		for (int i = 0, count = 1; i != nodes; ++i) {
+			if (i == node)
+				continue;
+
+			int pos = count++;
+
+			while (pos > 1 && numa_dist[node][order[pos - 1]] >
+						numa_dist[node][i]) {
+				order[pos] = order[pos - 1];
+				--pos;
+			}
+			order[pos] = i;
+		}
+	}
+}
+
+static void numa_dump(void)
+{
+	printf("numa nodes %d\n", nodes);
+	for (int i = 0; i != numa_ranges; ++i)
+		printf("    node %d memory 0x%llx-0x%llx\n", numa_range[i].node,
+					(unsigned long long)numa_range[i].begin,
+					(unsigned long long)numa_range[i].end);
+
+	for (int i = 0; i != local_apics; ++i)
+		printf("    node %d cpu %d\n", numa_cpu[i], i);
+
+	for (int i = 0; i != nodes; ++i) {
+		printf("    node %d distance:", i);
+		for (int j = 0; j != nodes; ++j)
+			printf(" %d", numa_dist[i][j]);
+		printf("\n");
+	}
+}
+
+void numa_setup(void)
+{
+	if (numa_parse_srat())
+		printf("SRAT not found, assume single numa node\n");
+	numa_parse_slit();
+	numa_order_setup();
+	numa_dump();
+}
+
+int numa_nodes(void)
+{
+	return nodes;
+}
+
+int cpu_node(int cpu)
+{
+	return numa_cpu[cpu];
+}
+
+int numa_node(void)
+{
+	return numa_cpu[cpu_id()];
+}
+
+int numa_distance(int from, int to)
+{
+	return numa_dist[from][to];
+}
+
+const int *numa_node_order(int node)
+{
+	return numa_order[node];
+}
+
+int numa_addr_node(uintptr_t addr, uintptr_t *end)
+{
+	uintptr_t next = UINTPTR_MAX;
+
+	for (int i = 0; i != numa_ranges; ++i) {
+		const struct numa_range *range = &numa_range[i];
+
+		if (addr >= range->begin && addr < range->end) {
+			*end = range->end;
+			return range->node;
+		}
+
+		if (range->begin > addr && range->begin < next)
+			next = range->begin;
+	}
+
+	/* memory not described by SRAT goes to node 0 */
+	*end = next;
+	return 0;
+}
+
+uintptr_t numa_balloc_alloc(size_t size, uintptr_t align, int node)
+{
+	for (int i = 0; i != numa_ranges; ++i) {
+		const struct numa_range *range = &numa_range[i];
+
+		if (range->node != node)
+			continue;
+
+		const uintptr_t from = range->begin > BOOTSTRAP_BEGIN
+					? range->begin : BOOTSTRAP_BEGIN;
+		const uintptr_t to = range->end < BOOTSTRAP_END
+					? range->end : BOOTSTRAP_END;
+
+		if (from >= to)
+			continue;
+
+		const uintptr_t addr = __balloc_alloc(size, align, from, to);
+
+		if (addr != to)
+			return addr;
+	}
+
+	return __balloc_alloc(size, align, BOOTSTRAP_BEGIN, BOOTSTRAP_END);
+}
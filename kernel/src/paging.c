@@ -8,7 +8,7 @@
 
 
 static struct mem_cache pt_range_cache;
-static struct page_table kernel_pt;
+struct page_table kernel_pt;
 
 
 static int pml_shift(int level)
@@ -334,7 +334,7 @@ static void __pt_unmap(struct page_table *pt, uintptr_t begin, uintptr_t end)
 		struct rb_node *node = rb_next(&range->rb);
 
 		prev = node ? TREE_ENTRY(node, struct pt_range, rb) : 0;
-		if (prev->end <= begin)
+		if (range->end <= begin)
 			continue;
 
 		pt_remove_range(pt, range);
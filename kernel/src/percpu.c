@@ -5,6 +5,7 @@
 #include <string.h>
 #include <debug.h>
 #include <apic.h>
+#include <numa.h>
 #include <cpu.h>
 
 
@@ -34,11 +35,9 @@ void percpu_setup(void)
 	const size_t percpu_size = percpu_phys_end - percpu_phys_begin;
 
 	for (int i = 0; i != local_apics; ++i) {
-		const uintptr_t addr = __balloc_alloc(
+		const uintptr_t addr = numa_balloc_alloc(
 					percpu_size + sizeof(uint64_t),
-					PAGE_SIZE,
-					/* from = */BOOTSTRAP_BEGIN,
-					/* to = */BOOTSTRAP_END);
+					PAGE_SIZE, cpu_node(i));
 		BUG_ON(addr == BOOTSTRAP_END);
 
 		uint64_t * const baseptr = (uint64_t *)(addr + percpu_size);
@@ -16,13 +16,17 @@ static __percpu struct list_head rcu_cpu_curr;
 
 static struct spinlock rcu_lock;
 static unsigned long rcu_cpumask;
+static unsigned long rcu_idlemask;
 static unsigned long rcu_gen;
 
 
+/* idle cpus with the tick stopped are in quiescent state all the time,
+ * so grace period doesn't wait for them */
 static void rcu_reset_cpumask(void)
 {
 	for (int i = 0; i != cpu_count(); ++i)
 		rcu_cpumask |= 1ul << i;
+	rcu_cpumask &= ~rcu_idlemask;
 }
 
 static void __rcu_check_qs(void)
@@ -33,7 +37,7 @@ static void __rcu_check_qs(void)
 		return;
 
 	rcu_cpumask &= ~mask;
-	if (!rcu_cpumask)
+	if (rcu_cpumask)
 		return;
 
 	rcu_reset_cpumask();
@@ -85,10 +89,35 @@ static void rcu_cpu_check_qs(void)
 
 void rcu_tick(void)
 {
-	const int turn = current_time() % cpu_count();
+	rcu_cpu_check_qs();
+}
+
+int rcu_pending(void)
+{
+	return !list_empty(&rcu_cpu_next) || !list_empty(&rcu_cpu_curr);
+}
+
+void rcu_idle_enter(void)
+{
+	const unsigned long flags = spin_lock_save(&rcu_lock);
+
+	rcu_idlemask |= 1ul << cpu_id();
+	__rcu_check_qs();
+	spin_unlock_restore(&rcu_lock, flags);
+}
+
+/* if every cpu was idle when the last grace period ended the new one
+ * waits for nobody and nobody would ever end it, so the first cpu back
+ * joins it */
+void rcu_idle_exit(void)
+{
+	const unsigned long mask = 1ul << cpu_id();
+	const unsigned long flags = spin_lock_save(&rcu_lock);
 
-	if (turn == cpu_id())
-		rcu_cpu_check_qs();
+	rcu_idlemask &= ~mask;
+	if (!rcu_cpumask)
+		rcu_cpumask = mask;
+	spin_unlock_restore(&rcu_lock, flags);
 }
 
 void rcu_report_qs(void)
@@ -0,0 +1,124 @@
+#include <scheduler.h>
+#include <rwsem.h>
+
+
+struct rwsem_waiter {
+	struct wait_entry wait;
+	int writer;
+	int granted;
+};
+
+
+void rwsem_init(struct rw_semaphore *sem)
+{
+	wait_queue_init(&sem->wait);
+	sem->count = 0;
+}
+
+/* Hands the semaphore over to the head of the queue: either the first
+ * writer or all the readers in front of the next writer at once. */
+static void __rwsem_grant(struct rw_semaphore *sem)
+{
+	struct list_head *head = &sem->wait.waiters;
+
+	while (!list_empty(head)) {
+		struct rwsem_waiter *waiter = LIST_ENTRY(list_first(head),
+					struct rwsem_waiter, wait.ll);
+
+		if (waiter->writer) {
+			if (sem->count)
+				break;
+			sem->count = -1;
+		} else {
+			if (sem->count < 0)
+				break;
+			++sem->count;
+		}
+
+		waiter->granted = 1;
+		__wait_wake(&sem->wait);
+	}
+}
+
+static void rwsem_wait(struct rw_semaphore *sem, int writer,
+			unsigned long flags)
+{
+	struct rwsem_waiter waiter;
+
+	wait_entry_init(&waiter.wait);
+	waiter.writer = writer;
+	waiter.granted = 0;
+
+	while (!waiter.granted) {
+		__wait_prepare(&sem->wait, &waiter.wait);
+		spin_unlock_restore(&sem->wait.lock, flags);
+		schedule();
+		flags = spin_lock_save(&sem->wait.lock);
+	}
+	__wait_finish(&sem->wait, &waiter.wait);
+	spin_unlock_restore(&sem->wait.lock, flags);
+}
+
+int rwsem_trydown_read(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+	const int taken = sem->count >= 0 && list_empty(&sem->wait.waiters);
+
+	if (taken)
+		++sem->count;
+	spin_unlock_restore(&sem->wait.lock, flags);
+	return taken;
+}
+
+void rwsem_down_read(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	if (sem->count >= 0 && list_empty(&sem->wait.waiters)) {
+		++sem->count;
+		spin_unlock_restore(&sem->wait.lock, flags);
+		return;
+	}
+	rwsem_wait(sem, 0, flags);
+}
+
+void rwsem_up_read(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	if (!--sem->count)
+		__rwsem_grant(sem);
+	spin_unlock_restore(&sem->wait.lock, flags);
+}
+
+int rwsem_trydown_write(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+	const int taken = !sem->count;
+
+	if (taken)
+		sem->count = -1;
+	spin_unlock_restore(&sem->wait.lock, flags);
+	return taken;
+}
+
+void rwsem_down_write(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	if (!sem->count) {
+		sem->count = -1;
+		spin_unlock_restore(&sem->wait.lock, flags);
+		return;
+	}
+	rwsem_wait(sem, 1, flags);
+}
+
+void rwsem_up_write(struct rw_semaphore *sem)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	sem->count = 0;
+	__rwsem_grant(sem);
+	spin_unlock_restore(&sem->wait.lock, flags);
+}
@@ -1,66 +1,551 @@
 #include <scheduler.h>
+#include <string.h>
 #include <spinlock.h>
 #include <thread.h>
 #include <percpu.h>
 #include <debug.h>
+#include <apic.h>
+#include <ints.h>
 #include <alloc.h>
 #include <time.h>
+#include <rbtree.h>
 #include <list.h>
+#include <bitops.h>
+#include <numa.h>
+#include <vmem.h>
 #include <cpu.h>
 #include <rcu.h>
 
-#define SCHEDULER_SLICE	10
+#define SCHEDULER_QUEUE	256
+#define SCHEDULER_GLOBAL_POLL	61
+#define SCHEDULER_STEAL_SCAN	8
 
+/* Per cpu run queue is a ring buffer in the spirit of Chase-Lev deque:
+ * only the owner pushes at the tail, while both the owner and thieves
+ * take threads from the head with CAS, so the owner pushes without any
+ * atomic RMW and threads still run in FIFO order. When the ring is full
+ * half of it goes to the global queue. */
 struct scheduler_queue {
-	struct list_head ll;
-	struct spinlock lock;
-	struct list_head threads;
+	atomic_uint head;
+	atomic_uint tail;
+	struct thread * _Atomic threads[SCHEDULER_QUEUE];
 	int cpu_id;
+
+	/* updated only by the owner */
+	unsigned long schedules;
+	unsigned long steal_attempts;
+	unsigned long steal_success;
+	unsigned long stolen;
+	unsigned long long rand;
+
+	/* Fair class: threads the owner took from the ring wait here ordered
+	 * by weighted virtual runtime. The lock is for thieves, which take
+	 * the rightmost thread when the ring is empty. */
+	struct spinlock lock;
+	struct rb_tree fair;
+	atomic_uint fair_count;
+	unsigned long long min_vruntime;
+
+	/* Real time classes, also under the lock: list per priority, bit
+	 * THREAD_RT_PRIOS - 1 - prio of the bitmap is set when the list
+	 * isn't empty, so bsf finds the most urgent one. */
+	unsigned long rt_bitmap;
+	atomic_uint rt_count;
+	struct list_head rt[THREAD_RT_PRIOS];
 };
 
 static __percpu struct scheduler_queue *cpu_queue;
 static __percpu struct thread *cpu_idle;
 static __percpu atomic_uint preempt_count;
-static struct scheduler_queue *queue;
+static __percpu int need_resched;
+static struct scheduler_queue *queue[MAX_CPU_NR];
 static size_t queues;
 
+enum scheduler_idle_state {
+	CPU_RUNNING,
+	CPU_IDLE,
+	CPU_WAKING
+};
+
+/* State word is what an idle cpu monitors with mwait, so every cpu gets
+ * its own cache line. wake_tsc is set by a waker, the rest is updated by
+ * the owner only. */
+struct scheduler_idle {
+	atomic_int state;
+	atomic_ullong wake_tsc;
+	unsigned long long start;
+	unsigned long idles;
+	unsigned long long idle_cycles;
+	unsigned long wakeups;
+	unsigned long long wakeup_cycles;
+	unsigned long long wakeup_max;
+} __attribute__((aligned(64)));
+
+static struct scheduler_idle cpu_idle_state[MAX_CPU_NR];
+static int cpu_has_mwait;
+
+static struct spinlock global_lock;
+static struct list_head global_threads;
+static atomic_ulong global_count;
+
 
 static void scheduler_queue_setup(struct scheduler_queue *queue, int cpu_id)
 {
-	spin_lock_init(&queue->lock);
-	list_init(&queue->threads);
+	atomic_store_explicit(&queue->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->tail, 0, memory_order_relaxed);
 	queue->cpu_id = cpu_id;
+	queue->schedules = 0;
+	queue->steal_attempts = 0;
+	queue->steal_success = 0;
+	queue->stolen = 0;
+	queue->rand = ((unsigned long long)cpu_id << 32) | 0x9e3779b9ull;
+	spin_lock_init(&queue->lock);
+	queue->fair.root = 0;
+	atomic_store_explicit(&queue->fair_count, 0, memory_order_relaxed);
+	queue->min_vruntime = 0;
+	queue->rt_bitmap = 0;
+	atomic_store_explicit(&queue->rt_count, 0, memory_order_relaxed);
+	for (int i = 0; i != THREAD_RT_PRIOS; ++i)
+		list_init(&queue->rt[i]);
 }
 
-static struct thread *__scheduler_queue_next(struct scheduler_queue *queue)
+static unsigned scheduler_queue_size(struct scheduler_queue *queue)
 {
-	struct list_head *head = &queue->threads;
+	const unsigned head = atomic_load_explicit(&queue->head,
+				memory_order_acquire);
+	const unsigned tail = atomic_load_explicit(&queue->tail,
+				memory_order_acquire);
 
-	if (list_empty(head))
-		return 0;
+	return tail - head;
+}
+
+static unsigned scheduler_runnable(struct scheduler_queue *queue)
+{
+	return scheduler_queue_size(queue) + atomic_load_explicit(
+				&queue->fair_count, memory_order_relaxed) +
+				atomic_load_explicit(&queue->rt_count,
+				memory_order_relaxed);
+}
+
+static int scheduler_rt(const struct thread *thread)
+{
+	return thread->policy != THREAD_FAIR;
+}
+
+static int scheduler_rt_bit(const struct thread *thread)
+{
+	return THREAD_RT_PRIOS - 1 - thread->rt_priority;
+}
+
+static void scheduler_rt_enqueue(struct scheduler_queue *queue,
+			struct thread *thread, int head)
+{
+	const int bit = scheduler_rt_bit(thread);
+
+	if (head)
+		list_add(&thread->ll, &queue->rt[bit]);
+	else
+		list_add_tail(&thread->ll, &queue->rt[bit]);
+	queue->rt_bitmap |= 1ul << bit;
+	atomic_fetch_add_explicit(&queue->rt_count, 1, memory_order_relaxed);
+}
 
-	struct thread *thread = LIST_ENTRY(list_first(head), struct thread, ll);
+static void scheduler_rt_remove(struct scheduler_queue *queue,
+			struct thread *thread)
+{
+	const int bit = scheduler_rt_bit(thread);
 
 	list_del(&thread->ll);
+	if (list_empty(&queue->rt[bit]))
+		queue->rt_bitmap &= ~(1ul << bit);
+	atomic_fetch_sub_explicit(&queue->rt_count, 1, memory_order_relaxed);
+}
+
+static struct thread *scheduler_rt_dequeue(struct scheduler_queue *queue)
+{
+	const int bit = bsf(queue->rt_bitmap);
+	struct thread *thread = LIST_ENTRY(list_first(&queue->rt[bit]),
+				struct thread, ll);
+
+	scheduler_rt_remove(queue, thread);
 	return thread;
 }
 
-static struct thread *scheduler_queue_next(struct scheduler_queue *queue)
+static unsigned long scheduler_online(void)
+{
+	return (1ul << queues) - 1;
+}
+
+static int scheduler_cpu_allowed(const struct thread *thread, int cpu)
+{
+	return (thread->affinity >> cpu) & 1;
+}
+
+/* Pinned threads never go to the ring, since ring steals and overflows
+ * move threads in batches without looking at them. */
+static int scheduler_pinned(const struct thread *thread)
 {
-	const unsigned long flags = spin_lock_save(&queue->lock);
-	struct thread *thread = __scheduler_queue_next(queue);
+	return (thread->affinity & scheduler_online()) != scheduler_online();
+}
+
+/* Whether the thread should take the cpu from the current one. */
+static int scheduler_outranks(const struct thread *thread,
+			const struct thread *current)
+{
+	if (!scheduler_rt(thread))
+		return 0;
+	return current == cpu_idle || !scheduler_rt(current) ||
+				thread->rt_priority > current->rt_priority;
+}
+
+/* nice 0 is 1024 and every nice level is about 10% of cpu time */
+static const unsigned long scheduler_weights[] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+
+#define SCHEDULER_NICE_0_WEIGHT	1024
+
+static unsigned long long fair_wakeup_credit;
+
+unsigned long scheduler_nice_weight(int nice)
+{
+	return scheduler_weights[nice - SCHEDULER_NICE_MIN];
+}
+
+static void scheduler_account(struct thread *thread)
+{
+	const unsigned long long now = rdtsc();
+	const unsigned long long delta = now - thread->exec_start;
+
+	thread->exec_start = now;
+	thread->runtime += delta;
+	thread->vruntime += delta * SCHEDULER_NICE_0_WEIGHT / thread->weight;
+}
+
+/* Sleepers get at most half a slice ahead of the others, so a thread that
+ * slept for long doesn't monopolize the cpu when it wakes up. */
+static void scheduler_fair_enqueue(struct scheduler_queue *queue,
+			struct thread *thread)
+{
+	struct rb_node **plink = &queue->fair.root;
+	struct rb_node *parent = 0;
+
+	if (thread->vruntime + fair_wakeup_credit < queue->min_vruntime)
+		thread->vruntime = queue->min_vruntime - fair_wakeup_credit;
+
+	while (*plink) {
+		const struct thread *other = TREE_ENTRY(*plink,
+					struct thread, rb);
+
+		parent = *plink;
+		if (thread->vruntime < other->vruntime)
+			plink = &parent->left;
+		else
+			plink = &parent->right;
+	}
+
+	rb_link(&thread->rb, parent, plink);
+	rb_insert(&thread->rb, &queue->fair);
+	atomic_fetch_add_explicit(&queue->fair_count, 1, memory_order_relaxed);
+}
+
+static void scheduler_fair_dequeue(struct scheduler_queue *queue,
+			struct thread *thread)
+{
+	rb_erase(&thread->rb, &queue->fair);
+	atomic_fetch_sub_explicit(&queue->fair_count, 1, memory_order_relaxed);
+}
+
+static struct thread *scheduler_fair_first(struct scheduler_queue *queue)
+{
+	struct rb_node *node = rb_leftmost(&queue->fair);
+
+	return node ? TREE_ENTRY(node, struct thread, rb) : 0;
+}
+
+static void scheduler_global_put(struct list_head *threads, unsigned count)
+{
+	const unsigned long flags = spin_lock_save(&global_lock);
+
+	list_splice(threads, global_threads.prev);
+	atomic_fetch_add_explicit(&global_count, count, memory_order_relaxed);
+	spin_unlock_restore(&global_lock, flags);
+}
+
+static struct thread *scheduler_global_get(void)
+{
+	if (!atomic_load_explicit(&global_count, memory_order_relaxed))
+		return 0;
 
-	spin_unlock_restore(&queue->lock, flags);
+	const unsigned long flags = spin_lock_save(&global_lock);
+	struct thread *thread = 0;
+
+	if (!list_empty(&global_threads)) {
+		thread = LIST_ENTRY(list_first(&global_threads),
+					struct thread, ll);
+		list_del(&thread->ll);
+		atomic_fetch_sub_explicit(&global_count, 1,
+					memory_order_relaxed);
+	}
+	spin_unlock_restore(&global_lock, flags);
 	return thread;
 }
 
-static void scheduler_queue_insert(struct scheduler_queue *queue,
+/* Move the older half of the full ring and the new thread to the global
+ * queue, fails if thieves took something meanwhile, so push can retry. */
+static int scheduler_queue_overflow(struct scheduler_queue *queue,
+			struct thread *thread, unsigned head, unsigned tail)
+{
+	const unsigned count = (tail - head) / 2;
+	struct list_head threads;
+
+	BUG_ON(tail - head != SCHEDULER_QUEUE);
+
+	list_init(&threads);
+	for (unsigned i = 0; i != count; ++i) {
+		struct thread *next = atomic_load_explicit(
+			&queue->threads[(head + i) % SCHEDULER_QUEUE],
+			memory_order_relaxed);
+
+		list_add_tail(&next->ll, &threads);
+	}
+
+	if (!atomic_compare_exchange_strong_explicit(&queue->head, &head,
+				head + count, memory_order_release,
+				memory_order_relaxed))
+		return -1;
+
+	list_add_tail(&thread->ll, &threads);
+	scheduler_global_put(&threads, count + 1);
+	return 0;
+}
+
+static void scheduler_queue_push(struct scheduler_queue *queue,
 			struct thread *thread)
 {
-	const unsigned long flags = spin_lock_save(&queue->lock);
+	while (1) {
+		const unsigned head = atomic_load_explicit(&queue->head,
+					memory_order_acquire);
+		const unsigned tail = atomic_load_explicit(&queue->tail,
+					memory_order_relaxed);
+
+		if (tail - head < SCHEDULER_QUEUE) {
+			atomic_store_explicit(
+				&queue->threads[tail % SCHEDULER_QUEUE],
+				thread, memory_order_relaxed);
+			atomic_store_explicit(&queue->tail, tail + 1,
+						memory_order_release);
+			return;
+		}
+
+		if (!scheduler_queue_overflow(queue, thread, head, tail))
+			return;
+	}
+}
+
+static struct thread *scheduler_queue_pop(struct scheduler_queue *queue)
+{
+	while (1) {
+		unsigned head = atomic_load_explicit(&queue->head,
+					memory_order_acquire);
+		const unsigned tail = atomic_load_explicit(&queue->tail,
+					memory_order_relaxed);
+
+		if (head == tail)
+			return 0;
+
+		struct thread *thread = atomic_load_explicit(
+			&queue->threads[head % SCHEDULER_QUEUE],
+			memory_order_relaxed);
+
+		if (atomic_compare_exchange_weak_explicit(&queue->head, &head,
+					head + 1, memory_order_release,
+					memory_order_relaxed))
+			return thread;
+	}
+}
+
+/* Take half of the victim threads, return one of them and put the rest
+ * into our own queue, which must be empty at this point. */
+static struct thread *scheduler_queue_steal(struct scheduler_queue *queue,
+			struct scheduler_queue *victim)
+{
+	const unsigned tail = atomic_load_explicit(&queue->tail,
+				memory_order_relaxed);
+
+	while (1) {
+		unsigned head = atomic_load_explicit(&victim->head,
+					memory_order_acquire);
+		const unsigned vtail = atomic_load_explicit(&victim->tail,
+					memory_order_acquire);
+		const unsigned size = vtail - head;
+		const unsigned count = size - size / 2;
+
+		if (!size)
+			return 0;
+
+		/* head and tail were read at different times */
+		if (size > SCHEDULER_QUEUE)
+			continue;
+
+		for (unsigned i = 0; i != count; ++i) {
+			struct thread *thread = atomic_load_explicit(
+				&victim->threads[(head + i) % SCHEDULER_QUEUE],
+				memory_order_relaxed);
+
+			atomic_store_explicit(
+				&queue->threads[(tail + i) % SCHEDULER_QUEUE],
+				thread, memory_order_relaxed);
+		}
+
+		if (!atomic_compare_exchange_weak_explicit(&victim->head, &head,
+					head + count, memory_order_acq_rel,
+					memory_order_relaxed))
+			continue;
+
+		struct thread *thread = atomic_load_explicit(
+			&queue->threads[(tail + count - 1) % SCHEDULER_QUEUE],
+			memory_order_relaxed);
+
+		queue->stolen += count;
+		if (count > 1)
+			atomic_store_explicit(&queue->tail, tail + count - 1,
+						memory_order_release);
+		return thread;
+	}
+}
+
+/* Ring of the victim is empty, so take the thread that would run last
+ * from its tree. Virtual runtime is relative to the queue min_vruntime,
+ * so it's moved over to our timeline. */
+static void scheduler_fair_migrate(struct thread *thread,
+			const struct scheduler_queue *from,
+			const struct scheduler_queue *to)
+{
+	if (thread->vruntime > from->min_vruntime)
+		thread->vruntime -= from->min_vruntime;
+	else
+		thread->vruntime = 0;
+	thread->vruntime += to->min_vruntime;
+}
+
+/* Only a few threads are looked at, most of them are allowed to run
+ * anywhere anyway. */
+static struct thread *scheduler_rt_steal(struct scheduler_queue *victim,
+			int cpu)
+{
+	unsigned long bitmap = victim->rt_bitmap;
+	int scan = 0;
+
+	while (bitmap && scan != SCHEDULER_STEAL_SCAN) {
+		const int bit = bsf(bitmap);
+		struct list_head *head = &victim->rt[bit];
+
+		for (struct list_head *ptr = head->next; ptr != head &&
+					scan != SCHEDULER_STEAL_SCAN;
+					ptr = ptr->next, ++scan) {
+			struct thread *thread = LIST_ENTRY(ptr,
+						struct thread, ll);
+
+			if (scheduler_cpu_allowed(thread, cpu)) {
+				scheduler_rt_remove(victim, thread);
+				return thread;
+			}
+		}
+		bitmap &= ~(1ul << bit);
+	}
+	return 0;
+}
+
+static struct thread *scheduler_fair_steal_tree(struct scheduler_queue *victim,
+			int cpu)
+{
+	struct rb_node *node = rb_rightmost(&victim->fair);
+
+	for (int scan = 0; node && scan != SCHEDULER_STEAL_SCAN;
+				node = rb_prev(node), ++scan) {
+		struct thread *thread = TREE_ENTRY(node, struct thread, rb);
+
+		if (scheduler_cpu_allowed(thread, cpu)) {
+			scheduler_fair_dequeue(victim, thread);
+			return thread;
+		}
+	}
+	return 0;
+}
+
+/* Queued real time thread waits for a more urgent one, so it's the first
+ * to go, otherwise the fair thread that would run last is taken. */
+static struct thread *scheduler_fair_steal(struct scheduler_queue *queue,
+			struct scheduler_queue *victim)
+{
+	if (!atomic_load_explicit(&victim->fair_count, memory_order_relaxed) &&
+		!atomic_load_explicit(&victim->rt_count, memory_order_relaxed))
+		return 0;
+
+	if (!spin_trylock(&victim->lock))
+		return 0;
+
+	struct thread *thread = scheduler_rt_steal(victim, queue->cpu_id);
+
+	if (!thread && (thread = scheduler_fair_steal_tree(victim,
+				queue->cpu_id)))
+		scheduler_fair_migrate(thread, victim, queue);
+	spin_unlock(&victim->lock);
+
+	if (thread)
+		++queue->stolen;
+	return thread;
+}
+
+static unsigned scheduler_rand(struct scheduler_queue *queue)
+{
+	unsigned long long x = queue->rand;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	queue->rand = x;
+	return (unsigned)(x >> 32);
+}
+
+/* Victims are visited starting from a random one, so idle cpus don't
+ * all go after the same queue. */
+static struct thread *scheduler_steal(struct scheduler_queue *self)
+{
+	if (queues < 2)
+		return 0;
 
-	list_add_tail(&thread->ll, &queue->threads);
-	spin_unlock_restore(&queue->lock, flags);
+	const size_t start = scheduler_rand(self) % queues;
+
+	for (size_t i = 0; i != queues; ++i) {
+		struct scheduler_queue *victim = queue[(start + i) % queues];
+
+		if (victim == self)
+			continue;
+
+		++self->steal_attempts;
+		if (!scheduler_runnable(victim))
+			continue;
+
+		struct thread *thread = scheduler_queue_steal(self, victim);
+
+		if (!thread)
+			thread = scheduler_fair_steal(self, victim);
+
+		if (thread) {
+			++self->steal_success;
+			return thread;
+		}
+	}
+	return 0;
 }
 
 static int can_preempt(void)
@@ -68,9 +553,17 @@ static int can_preempt(void)
 	return atomic_load_explicit(&preempt_count, memory_order_relaxed) == 0;
 }
 
+/* Preemption requested while it was disabled happens as soon as it's
+ * enabled again. With interrupts disabled, and so in interrupt handlers
+ * too, the caller may still depend on staying on this cpu, so the switch
+ * is left to the timer and wakeup interrupts. */
 void preempt_enable(void)
 {
-	atomic_fetch_add_explicit(&preempt_count, 1, memory_order_relaxed);
+	const unsigned count = atomic_fetch_add_explicit(&preempt_count, 1,
+				memory_order_relaxed);
+
+	if (count == (unsigned)-1 && need_resched && (rflags() & RFLAGS_IF))
+		schedule();
 }
 
 void preempt_disable(void)
@@ -84,48 +577,231 @@ static int scheduler_need_preemption(struct thread *thread)
 
 	BUG_ON(time < thread->timestamp);
 
-	return can_preempt() && (thread == cpu_idle ||
+	return can_preempt() && (need_resched || thread == cpu_idle ||
 		(thread_get_state(thread) != THREAD_ACTIVE) ||
 		(time - thread->timestamp > SCHEDULER_SLICE));
 }
 
-static struct thread *__scheduler_next_thread(void)
+static int scheduler_has_work(void)
 {
-	struct thread *next = scheduler_queue_next(cpu_queue);
+	if (scheduler_runnable(cpu_queue))
+		return 1;
 
-	if (next)
-		return next;
+	if (atomic_load_explicit(&global_count, memory_order_relaxed))
+		return 1;
 
-	const size_t this_cpu_pos = cpu_queue - queue;
-	size_t i = this_cpu_pos + 1 != queues ? this_cpu_pos + 1 : 0;
+	for (size_t i = 0; i != queues; ++i) {
+		if (scheduler_runnable(queue[i]))
+			return 1;
+	}
+	return 0;
+}
 
-	while (i != this_cpu_pos) {
-		if ((next = scheduler_queue_next(&queue[i])))
-			return next;
+/* Store to the state is enough to wake a cpu from mwait, hlt needs IPI. */
+static int scheduler_wake_cpu(int cpu)
+{
+	struct scheduler_idle *idle = &cpu_idle_state[cpu];
+	int state = CPU_IDLE;
 
-		if (++i == queues)
-			i = 0;
-	}
-	
-	struct thread *current = thread_current();
+	if (atomic_load_explicit(&idle->state,
+				memory_order_relaxed) != CPU_IDLE)
+		return 0;
 
-	if (thread_get_state(current) == THREAD_ACTIVE)
+	atomic_store_explicit(&idle->wake_tsc, rdtsc(),
+				memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&idle->state,
+				&state, CPU_WAKING,
+				memory_order_seq_cst,
+				memory_order_relaxed))
 		return 0;
 
-	return cpu_idle;
+	if (!cpu_has_mwait)
+		local_apic_icr_write(local_apic_ids[cpu],
+					IRQ_VECTOR(SCHEDULER_WAKEUP_IRQ)
+					| APIC_ICR_PHYSCAL
+					| APIC_ICR_ASSERT
+					| APIC_ICR_EDGE);
+	return 1;
+}
+
+/* Wake up one idle cpu, so it could take the work we've just queued. */
+static void scheduler_kick(void)
+{
+	const int this_cpu = cpu_id();
+
+	for (size_t i = 0; i != queues; ++i) {
+		if ((int)i != this_cpu && scheduler_wake_cpu(i))
+			return;
+	}
 }
 
-static void scheduler_preempt_thread(struct thread *prev)
+/* Idle cpus may have their tick stopped, so they need a nudge to notice
+ * changes made to the timer settings. */
+void scheduler_wake_all(void)
 {
-	const int state = thread_get_state(prev);
+	const int this_cpu = cpu_id();
 
-	if (prev == cpu_idle || state != THREAD_ACTIVE)
+	for (size_t i = 0; i != queues; ++i) {
+		if ((int)i != this_cpu)
+			scheduler_wake_cpu(i);
+	}
+}
+
+static void scheduler_idle_exit(struct scheduler_idle *idle)
+{
+	const int state = atomic_exchange_explicit(&idle->state, CPU_RUNNING,
+				memory_order_relaxed);
+
+	if (state == CPU_RUNNING)
+		return;
+
+	/* an interrupt may switch away from the idle thread right away, so
+	 * it's the only place where the cpu leaves idle */
+	rcu_idle_exit();
+	vmem_cpu_tick();
+
+	const unsigned long long now = rdtsc();
+
+	idle->idle_cycles += now - idle->start;
+	if (state != CPU_WAKING)
 		return;
 
-	const unsigned long flags = spin_lock_save(&cpu_queue->lock);
+	const unsigned long long wake = atomic_load_explicit(&idle->wake_tsc,
+				memory_order_relaxed);
+	const unsigned long long latency = now > wake ? now - wake : 0;
+
+	++idle->wakeups;
+	idle->wakeup_cycles += latency;
+	if (latency > idle->wakeup_max)
+		idle->wakeup_max = latency;
+}
+
+/* State is published before the last check for work, while wakers queue
+ * work first and check the state after, so one of us sees the other. */
+static void scheduler_idle(void)
+{
+	struct scheduler_idle *idle = &cpu_idle_state[cpu_id()];
+
+	local_int_disable();
+	idle->start = rdtsc();
+	atomic_store_explicit(&idle->state, CPU_IDLE, memory_order_seq_cst);
+
+	if (scheduler_has_work()) {
+		atomic_store_explicit(&idle->state, CPU_RUNNING,
+					memory_order_relaxed);
+		local_int_enable();
+		return;
+	}
+
+	++idle->idles;
+	rcu_idle_enter();
+	time_cpu_rearm();
+	if (cpu_has_mwait) {
+		cpu_monitor(&idle->state);
+		if (atomic_load_explicit(&idle->state,
+					memory_order_seq_cst) == CPU_IDLE)
+			cpu_mwait();
+		else
+			local_int_enable();
+	} else {
+		cpu_halt();
+	}
+
+	local_int_disable();
+	scheduler_idle_exit(idle);
+	local_int_enable();
+}
+
+/* The most urgent real time thread runs first. A running real time thread
+ * keeps the cpu unless there is a more urgent one, or one of the same
+ * priority and the round robin slice is over. Returns the current thread
+ * if it should keep running and 0 if it's up to the fair class. */
+static struct thread *scheduler_rt_next(struct scheduler_queue *queue,
+			struct thread *current, int running)
+{
+	const int rt = running && scheduler_rt(current);
+
+	if (!queue->rt_bitmap)
+		return rt ? current : 0;
+
+	if (rt) {
+		const int bit = bsf(queue->rt_bitmap);
+		const int cbit = scheduler_rt_bit(current);
+		const int expired = current_time() - current->timestamp >
+					SCHEDULER_SLICE;
+
+		if (cbit < bit || (cbit == bit &&
+				(current->policy == THREAD_FIFO || !expired)))
+			return current;
+	}
+
+	return scheduler_rt_dequeue(queue);
+}
+
+/* Threads the owner finds in its ring go to their class queues. Fair
+ * leftmost thread runs next, unless the current thread is still behind
+ * it, in which case the current thread is returned. */
+static struct thread *scheduler_queue_next(struct scheduler_queue *queue,
+			struct thread *current)
+{
+	const int running = current != cpu_idle &&
+				thread_get_state(current) == THREAD_ACTIVE;
+	unsigned long long min_vruntime = running ? current->vruntime : ~0ull;
+	struct thread *next;
+
+	spin_lock(&queue->lock);
+	while ((next = scheduler_queue_pop(queue))) {
+		if (scheduler_rt(next))
+			scheduler_rt_enqueue(queue, next, 0);
+		else
+			scheduler_fair_enqueue(queue, next);
+	}
+
+	if ((next = scheduler_rt_next(queue, current, running))) {
+		spin_unlock(&queue->lock);
+		return next;
+	}
+
+	next = scheduler_fair_first(queue);
+	if (next && next->vruntime < min_vruntime)
+		min_vruntime = next->vruntime;
+	if (min_vruntime != ~0ull && min_vruntime > queue->min_vruntime)
+		queue->min_vruntime = min_vruntime;
+
+	if (next && running && current->vruntime < next->vruntime)
+		next = current;
+	else if (next)
+		scheduler_fair_dequeue(queue, next);
+	spin_unlock(&queue->lock);
 
-	list_add_tail(&prev->ll, &cpu_queue->threads);
-	spin_unlock_restore(&cpu_queue->lock, flags);
+	return next;
+}
+
+/* The global queue is polled once in a while even if the local one isn't
+ * empty, otherwise threads that overflowed there could starve. */
+static struct thread *__scheduler_next_thread(void)
+{
+	struct thread *next;
+
+	if (++cpu_queue->schedules % SCHEDULER_GLOBAL_POLL == 0 &&
+				(next = scheduler_global_get()))
+		return next;
+
+	struct thread *current = thread_current();
+
+	if ((next = scheduler_queue_next(cpu_queue, current)))
+		return next == current ? 0 : next;
+
+	if ((next = scheduler_global_get()))
+		return next;
+
+	if ((next = scheduler_steal(cpu_queue)))
+		return next;
+
+	if (thread_get_state(current) == THREAD_ACTIVE)
+		return 0;
+
+	return cpu_idle;
 }
 
 static struct thread *scheduler_next_thread(void)
@@ -136,18 +812,164 @@ static struct thread *scheduler_next_thread(void)
 	if (!scheduler_need_preemption(prev))
 		return 0;
 
-	if ((next = __scheduler_next_thread())) {
-		scheduler_preempt_thread(prev);
+	need_resched = 0;
+	if (prev != cpu_idle)
+		scheduler_account(prev);
+
+	/* a migrating thread has to get off the cpu even if there is
+	 * nobody else to run */
+	if (!(next = __scheduler_next_thread()) && prev->migrate_cpu != -1)
+		next = cpu_idle;
+
+	if (next) {
+		next->cpu = cpu_id();
 		next->timestamp = current_time();
+		next->exec_start = rdtsc();
+		if (prev == cpu_idle)
+			scheduler_idle_exit(&cpu_idle_state[cpu_id()]);
+	} else {
+		/* nobody to run instead, start a new slice so the tick
+		 * doesn't fire every time from now on */
+		prev->timestamp = current_time();
 	}
 
 	return next;
 }
 
+unsigned long long scheduler_slice_end(void)
+{
+	struct thread *current = thread_current();
+
+	if (need_resched)
+		return current_time();
+	if (current == cpu_idle)
+		return 0;
+	return current->timestamp + SCHEDULER_SLICE + 1;
+}
+
+static void scheduler_resched_cpu(int cpu)
+{
+	local_apic_icr_write(local_apic_ids[cpu],
+				IRQ_VECTOR(SCHEDULER_WAKEUP_IRQ)
+				| APIC_ICR_PHYSCAL
+				| APIC_ICR_ASSERT
+				| APIC_ICR_EDGE);
+}
+
+/* Last cpu is preferred while its caches are likely still warm, that is
+ * when it's idle or it's us, otherwise the thread stays with the waker. */
+static int scheduler_select_cpu(struct thread *thread)
+{
+	const int this_cpu = cpu_id();
+	const int last = thread->cpu;
+
+	if (thread->migrate_cpu != -1) {
+		const int cpu = thread->migrate_cpu;
+
+		thread->migrate_cpu = -1;
+		return cpu;
+	}
+
+	if (last != -1 && scheduler_cpu_allowed(thread, last)) {
+		if (last == this_cpu || atomic_load_explicit(
+					&cpu_idle_state[last].state,
+					memory_order_relaxed) != CPU_RUNNING)
+			return last;
+	}
+
+	if (scheduler_cpu_allowed(thread, this_cpu))
+		return this_cpu;
+
+	if (last != -1 && scheduler_cpu_allowed(thread, last))
+		return last;
+
+	return bsf(thread->affinity & scheduler_online());
+}
+
+/* Only the owner pushes to its ring, so threads for other cpus go to the
+ * class queues under the lock, which serve as an inbox, as do pinned and
+ * real time threads. Returns the cpu the thread was queued on. */
+static int scheduler_enqueue(struct thread *thread, int head)
+{
+	const int this_cpu = cpu_id();
+	const int cpu = scheduler_select_cpu(thread);
+	struct scheduler_queue *target = queue[cpu];
+
+	if (cpu == this_cpu && !scheduler_rt(thread) &&
+				!scheduler_pinned(thread)) {
+		scheduler_queue_push(target, thread);
+		return cpu;
+	}
+
+	spin_lock(&target->lock);
+	if (scheduler_rt(thread)) {
+		scheduler_rt_enqueue(target, thread, head);
+	} else {
+		if (thread->cpu != -1 && thread->cpu != cpu)
+			scheduler_fair_migrate(thread, queue[thread->cpu],
+						target);
+		scheduler_fair_enqueue(target, thread);
+	}
+	spin_unlock(&target->lock);
+
+	/* remote real time thread may have to preempt whatever runs there,
+	 * the owner decides when it gets the interrupt */
+	if (cpu != this_cpu && !scheduler_wake_cpu(cpu) &&
+				scheduler_rt(thread))
+		scheduler_resched_cpu(cpu);
+	return cpu;
+}
+
+/* Preempted thread becomes visible to other cpus only after its context
+ * is saved, otherwise a thief could switch to a stale stack pointer. It's
+ * called on the new thread with interrupts disabled. */
+void scheduler_switch_finish(struct thread *prev)
+{
+	int state = thread_get_state(prev);
+
+	time_cpu_rearm();
+	if (prev == cpu_idle)
+		return;
+
+	/* from now on a waker queues the blocked thread, unless it has
+	 * already woken it up and left that to us */
+	if (state == THREAD_BLOCKED &&
+			atomic_compare_exchange_strong_explicit(&prev->state,
+				&state, THREAD_SLEEPING, memory_order_acq_rel,
+				memory_order_acquire))
+		return;
+
+	if (state != THREAD_ACTIVE)
+		return;
+
+	/* real time thread preempted by a more urgent one keeps its place
+	 * at the head, the one out of its round robin slice goes to the
+	 * tail */
+	const int expired = current_time() - prev->timestamp > SCHEDULER_SLICE;
+
+	scheduler_enqueue(prev, prev->policy == THREAD_FIFO || !expired);
+	if (scheduler_runnable(cpu_queue) > 1)
+		scheduler_kick();
+}
+
 void scheduler_activate_thread(struct thread *thread)
 {
 	BUG_ON(thread_get_state(thread) != THREAD_ACTIVE);
-	scheduler_queue_insert(cpu_queue, thread);
+
+	/* only the owner pushes, and schedule() from the timer interrupt
+	 * pushes too */
+	const unsigned long flags = local_int_save();
+	const int cpu = scheduler_enqueue(thread, 0);
+
+	/* We might hold locks or run in an interrupt handler, so instead of
+	 * switching right here send an interrupt to ourselves: the switch
+	 * happens as soon as interrupts and preemption are enabled. */
+	if (cpu == cpu_id() && scheduler_outranks(thread, thread_current())) {
+		need_resched = 1;
+		scheduler_resched_cpu(cpu);
+	}
+	scheduler_kick();
+	local_int_restore(flags);
 }
 
 void schedule(void)
@@ -161,22 +983,66 @@ void schedule(void)
 	local_int_restore(flags);
 }
 
+/* The interrupt itself gets the cpu out of hlt, and it's also how a
+ * woken up real time thread preempts the current one. */
+static void scheduler_wakeup_handler(void)
+{
+	need_resched = 1;
+	schedule();
+}
+
+void scheduler_migrate(int cpu)
+{
+	struct thread *self = thread_current();
+	const unsigned long flags = local_int_save();
+
+	BUG_ON(!can_preempt());
+	if (cpu != cpu_id()) {
+		self->migrate_cpu = cpu;
+		need_resched = 1;
+		schedule();
+	}
+	local_int_restore(flags);
+}
+
 void scheduler_setup(void)
 {
 	queues = cpu_count();
-	queue = (struct scheduler_queue *)mem_alloc(queues * sizeof(*queue));
-	BUG_ON(!queue);
+	fair_wakeup_credit = time_tick_cycles() * SCHEDULER_SLICE / 2;
+	spin_lock_init(&global_lock);
+	list_init(&global_threads);
+
+	unsigned long eax = 1, ebx, ecx, edx;
+
+	cpuid(&eax, &ebx, &ecx, &edx);
+	cpu_has_mwait = (ecx & (1ul << 3)) != 0;
+	printf("scheduler idle uses %s\n", cpu_has_mwait ? "mwait" : "hlt");
+
+	struct irq_info info;
 
-	for (size_t i = 0; i != queues; ++i)
-		scheduler_queue_setup(queue + i, i);
+	memset(&info, 0, sizeof(info));
+	register_irq(SCHEDULER_WAKEUP_IRQ, &info);
+	register_irq_handler(SCHEDULER_WAKEUP_IRQ, &scheduler_wakeup_handler);
+
+	/* queue takes a page on the node of its cpu, so it doesn't share
+	 * cache lines with anything else */
+	BUG_ON(sizeof(struct scheduler_queue) > PAGE_SIZE);
+	for (size_t i = 0; i != queues; ++i) {
+		queue[i] = (struct scheduler_queue *)page_alloc_node(0, PA_ANY,
+					cpu_node(i));
+		BUG_ON(!queue[i]);
+		scheduler_queue_setup(queue[i], i);
+	}
 }
 
 static void scheduler_cpu_idle(void *unused)
 {
 	(void) unused;
 
-	while (1)
+	while (1) {
 		schedule();
+		scheduler_idle();
+	}
 }
 
 void scheduler_cpu_setup(void)
@@ -187,8 +1053,45 @@ void scheduler_cpu_setup(void)
 	thread_set_state(cpu_idle, THREAD_ACTIVE);
 
 	for (size_t i = 0; i != queues; ++i) {
-		if (queue[i].cpu_id != this_cpu_id)
+		if (queue[i]->cpu_id != this_cpu_id)
+			continue;
+		cpu_queue = queue[i];
+	}
+}
+
+void scheduler_stats(int cpu, struct scheduler_stats *stats)
+{
+	stats->steal_attempts = stats->steal_success = stats->stolen = 0;
+
+	for (size_t i = 0; i != queues; ++i) {
+		const struct scheduler_queue *rq = queue[i];
+
+		if (rq->cpu_id != cpu)
 			continue;
-		cpu_queue = &queue[i];
+		stats->steal_attempts = rq->steal_attempts;
+		stats->steal_success = rq->steal_success;
+		stats->stolen = rq->stolen;
+	}
+}
+
+void scheduler_dump(void)
+{
+	for (size_t i = 0; i != queues; ++i) {
+		const struct scheduler_queue *rq = queue[i];
+
+		printf("cpu %d scheduler: %lu steal attempts, %lu successful, "
+					"%lu threads stolen\n", rq->cpu_id,
+					rq->steal_attempts, rq->steal_success,
+					rq->stolen);
+
+		const struct scheduler_idle *idle = &cpu_idle_state[i];
+
+		printf("cpu %d idle: %lu times, %llu cycles, %lu wakeups, "
+					"%llu avg %llu max wakeup cycles\n",
+					rq->cpu_id, idle->idles,
+					idle->idle_cycles, idle->wakeups,
+					idle->wakeups ? idle->wakeup_cycles /
+						idle->wakeups : 0,
+					idle->wakeup_max);
 	}
 }
@@ -0,0 +1,128 @@
+#include <semaphore.h>
+#include <scheduler.h>
+#include <kernel.h>
+#include <thread.h>
+#include <time.h>
+#include <cpu.h>
+
+
+struct semaphore_waiter {
+	struct wait_entry wait;
+	struct timer timer;
+	struct semaphore *sem;
+	unsigned long units;
+	int granted;
+	int expired;
+};
+
+
+void semaphore_init(struct semaphore *sem, unsigned long count)
+{
+	wait_queue_init(&sem->wait);
+	sem->count = count;
+}
+
+/* Units are handed to the waiters right here, so a woken up waiter owns
+ * them already and never has to retry. */
+static void __semaphore_grant(struct semaphore *sem)
+{
+	struct list_head *head = &sem->wait.waiters;
+
+	while (!list_empty(head)) {
+		struct semaphore_waiter *waiter = LIST_ENTRY(list_first(head),
+					struct semaphore_waiter, wait.ll);
+
+		if (waiter->units > sem->count)
+			break;
+
+		sem->count -= waiter->units;
+		waiter->granted = 1;
+		__wait_wake(&sem->wait);
+	}
+}
+
+static void semaphore_timeout(struct timer *timer)
+{
+	struct semaphore_waiter *waiter = CONTAINER_OF(timer,
+				struct semaphore_waiter, timer);
+	struct semaphore *sem = waiter->sem;
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	/* the waiter might be gone once expired is set and the lock is
+	 * released, so the waiter is not touched after that */
+	waiter->expired = 1;
+	thread_wake(waiter->wait.thread);
+	spin_unlock_restore(&sem->wait.lock, flags);
+}
+
+int semaphore_down_timeout(struct semaphore *sem, unsigned long units,
+			unsigned long long ticks)
+{
+	struct semaphore_waiter waiter;
+	unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	if (list_empty(&sem->wait.waiters) && sem->count >= units) {
+		sem->count -= units;
+		spin_unlock_restore(&sem->wait.lock, flags);
+		return 0;
+	}
+
+	if (!ticks) {
+		spin_unlock_restore(&sem->wait.lock, flags);
+		return -1;
+	}
+
+	wait_entry_init(&waiter.wait);
+	waiter.sem = sem;
+	waiter.units = units;
+	waiter.granted = 0;
+	waiter.expired = 0;
+
+	timer_setup(&waiter.timer, &semaphore_timeout);
+	if (ticks != SEMAPHORE_FOREVER)
+		timer_add(&waiter.timer, current_time() + ticks);
+
+	while (!waiter.granted && !waiter.expired) {
+		__wait_prepare(&sem->wait, &waiter.wait);
+		spin_unlock_restore(&sem->wait.lock, flags);
+		schedule();
+		flags = spin_lock_save(&sem->wait.lock);
+	}
+	__wait_finish(&sem->wait, &waiter.wait);
+
+	/* we might have been the head holding back smaller requests */
+	if (!waiter.granted)
+		__semaphore_grant(sem);
+
+	/* a timer that is already running must finish with the waiter
+	 * before the waiter goes out of scope */
+	if (ticks != SEMAPHORE_FOREVER && !timer_del(&waiter.timer)) {
+		while (!waiter.expired) {
+			spin_unlock_restore(&sem->wait.lock, flags);
+			cpu_relax();
+			flags = spin_lock_save(&sem->wait.lock);
+		}
+	}
+	spin_unlock_restore(&sem->wait.lock, flags);
+
+	return waiter.granted ? 0 : -1;
+}
+
+void semaphore_down(struct semaphore *sem, unsigned long units)
+{
+	semaphore_down_timeout(sem, units, SEMAPHORE_FOREVER);
+}
+
+int semaphore_trydown(struct semaphore *sem, unsigned long units)
+{
+	return !semaphore_down_timeout(sem, units, 0);
+}
+
+void semaphore_up(struct semaphore *sem, unsigned long units)
+{
+	const unsigned long flags = spin_lock_save(&sem->wait.lock);
+
+	sem->count += units;
+	__semaphore_grant(sem);
+	spin_unlock_restore(&sem->wait.lock, flags);
+}
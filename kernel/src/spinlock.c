@@ -1,51 +1,354 @@
 #include <scheduler.h>
 #include <spinlock.h>
+#include <percpu.h>
+#include <debug.h>
 #include <ints.h>
 #include <cpu.h>
 
-static void __spin_lock(struct spinlock *lock)
+
+#ifdef LOCKSTAT
+/* statistics per lock class and call site, open addressing on both */
+#define LOCKSTAT_ENTRIES	256
+#define LOCKSTAT_CLAIMED	1
+#define LOCKSTAT_NO_CLASS	2
+
+struct lockstat {
+	atomic_uintptr_t class;
+	atomic_uintptr_t site;
+	atomic_ulong count;
+	atomic_ulong contended;
+	atomic_ullong wait_total;
+	atomic_ullong wait_max;
+	atomic_ullong hold_max;
+};
+
+static struct lockstat lockstat[LOCKSTAT_ENTRIES];
+static atomic_ulong lockstat_dropped;
+
+
+/* Entry is claimed by setting the class to LOCKSTAT_CLAIMED, so nobody
+ * sees it before the site is set. Others spin on a claimed entry, so an
+ * interrupt taking a lock must not come in between on the same cpu. */
+static struct lockstat *lockstat_find(const void *class, const void *site)
+{
+	const uintptr_t key = class ? (uintptr_t)class : LOCKSTAT_NO_CLASS;
+	const size_t hash = ((key ^ ((uintptr_t)site << 1))
+				* 0x9e3779b97f4a7c15ull) >> 56;
+
+	for (size_t i = 0; i != LOCKSTAT_ENTRIES; ++i) {
+		struct lockstat *entry =
+			&lockstat[(hash + i) % LOCKSTAT_ENTRIES];
+		uintptr_t old = atomic_load_explicit(&entry->class,
+					memory_order_acquire);
+
+		if (!old) {
+			const unsigned long flags = local_int_save();
+
+			if (atomic_compare_exchange_strong_explicit(
+						&entry->class, &old,
+						LOCKSTAT_CLAIMED,
+						memory_order_acquire,
+						memory_order_acquire)) {
+				atomic_store_explicit(&entry->site,
+						(uintptr_t)site,
+						memory_order_relaxed);
+				atomic_store_explicit(&entry->class, key,
+						memory_order_release);
+				local_int_restore(flags);
+				return entry;
+			}
+			local_int_restore(flags);
+		}
+
+		while (old == LOCKSTAT_CLAIMED) {
+			cpu_relax();
+			old = atomic_load_explicit(&entry->class,
+						memory_order_acquire);
+		}
+
+		if (old == key && atomic_load_explicit(&entry->site,
+					memory_order_relaxed) == (uintptr_t)site)
+			return entry;
+	}
+	return 0;
+}
+
+static void lockstat_max(atomic_ullong *max, unsigned long long value)
 {
-	const unsigned ticket = atomic_fetch_add_explicit(&lock->next, 1,
+	unsigned long long old = atomic_load_explicit(max,
 				memory_order_relaxed);
 
-	while (atomic_load_explicit(&lock->current, memory_order_relaxed)
-				!= ticket)
-		cpu_relax();
-	atomic_thread_fence(memory_order_acquire);
+	while (old < value && !atomic_compare_exchange_weak_explicit(max,
+				&old, value, memory_order_relaxed,
+				memory_order_relaxed));
 }
 
-static void __spin_unlock(struct spinlock *lock)
+static void __lockstat_init(struct lockstat_lock *lock, const void *class)
+{
+	lock->class = class;
+	lock->stat = 0;
+	lock->acquired = 0;
+}
+
+static struct lockstat *__lockstat_account(const struct lockstat_lock *lock,
+			const void *site, unsigned long long start,
+			int contended)
 {
-	const unsigned current = atomic_load_explicit(&lock->current,
+	struct lockstat *entry = lockstat_find(lock->class, site);
+	const unsigned long long wait = rdtsc() - start;
+
+	if (!entry) {
+		atomic_fetch_add_explicit(&lockstat_dropped, 1,
+					memory_order_relaxed);
+		return 0;
+	}
+
+	atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed);
+	if (!contended)
+		return entry;
+
+	atomic_fetch_add_explicit(&entry->contended, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->wait_total, wait,
 				memory_order_relaxed);
+	lockstat_max(&entry->wait_max, wait);
+	return entry;
+}
 
-	atomic_thread_fence(memory_order_release);
-	atomic_store_explicit(&lock->current, current + 1,
+/* only exclusive owners may store the holder state in the lock */
+static void __lockstat_acquired(struct lockstat_lock *lock, const void *site,
+			unsigned long long start, int contended)
+{
+	lock->stat = __lockstat_account(lock, site, start, contended);
+	lock->acquired = rdtsc();
+}
+
+static void __lockstat_release(struct lockstat_lock *lock)
+{
+	if (lock->stat)
+		lockstat_max(&lock->stat->hold_max, rdtsc() - lock->acquired);
+}
+
+void lockstat_dump(void)
+{
+	printf("lock statistics:\n");
+	for (int i = 0; i != LOCKSTAT_ENTRIES; ++i) {
+		struct lockstat *entry = &lockstat[i];
+		const uintptr_t class = atomic_load_explicit(&entry->class,
+					memory_order_acquire);
+
+		if (!class || class == LOCKSTAT_CLAIMED)
+			continue;
+
+		const uintptr_t site = atomic_load_explicit(&entry->site,
+					memory_order_relaxed);
+		const unsigned long count = atomic_load_explicit(
+					&entry->count, memory_order_relaxed);
+		const unsigned long contended = atomic_load_explicit(
+					&entry->contended, memory_order_relaxed);
+		const unsigned long long wait = atomic_load_explicit(
+					&entry->wait_total, memory_order_relaxed);
+
+		printf("    class 0x%lx site 0x%lx: %lu acquired, "
+					"%lu contended, %llu wait cycles "
+					"(%llu max), %llu max hold cycles\n",
+					class == LOCKSTAT_NO_CLASS ?
+						0ul : (unsigned long)class,
+					(unsigned long)site, count, contended,
+					wait, atomic_load_explicit(
+						&entry->wait_max,
+						memory_order_relaxed),
+					atomic_load_explicit(
+						&entry->hold_max,
+						memory_order_relaxed));
+	}
+
+	const unsigned long dropped = atomic_load_explicit(&lockstat_dropped,
+				memory_order_relaxed);
+
+	if (dropped)
+		printf("    %lu acquisitions from untracked sites\n", dropped);
+}
+
+#define LOCK_SITE	__builtin_return_address(0)
+#define lockstat_init(lock, class)	__lockstat_init(&(lock)->stat, class)
+#define lockstat_acquired(lock, site, start, contended) \
+	__lockstat_acquired(&(lock)->stat, site, start, contended)
+#define lockstat_read_acquired(lock, site, start, contended) \
+	((void)__lockstat_account(&(lock)->stat, site, start, contended))
+#define lockstat_release(lock)	__lockstat_release(&(lock)->stat)
+#define lockstat_start()	rdtsc()
+#else
+void lockstat_dump(void)
+{
+	printf("lock statistics are disabled, build with LOCKSTAT=1\n");
+}
+
+#define LOCK_SITE	0
+#define lockstat_init(lock, class)	((void)(class))
+#define lockstat_acquired(lock, site, start, contended) \
+	((void)(site), (void)(start), (void)(contended))
+#define lockstat_read_acquired(lock, site, start, contended) \
+	lockstat_acquired(lock, site, start, contended)
+#define lockstat_release(lock)	((void)(lock))
+#define lockstat_start()	0ull
+#endif
+
+
+#define SPIN_LOCKED		1u
+#define SPIN_LOCKED_MASK	0xffu
+#define SPIN_TAIL_SHIFT		16
+#define SPIN_TAIL_MASK		(0xffffu << SPIN_TAIL_SHIFT)
+
+/* A cpu waits for at most one lock per context, and contexts nest as
+ * thread, interrupt and exception within an interrupt. */
+#define SPIN_NODES		4
+
+struct spin_node {
+	struct spin_node *_Atomic next;
+	atomic_int locked;
+} __attribute__((aligned (64)));
+
+static struct spin_node spin_nodes[MAX_CPU_NR][SPIN_NODES];
+static __percpu int spin_nodes_used;
+
+
+static unsigned spin_encode_tail(int cpu, int idx)
+{
+	return ((unsigned)((cpu + 1) << 2) | (unsigned)idx) << SPIN_TAIL_SHIFT;
+}
+
+static struct spin_node *spin_decode_tail(unsigned tail)
+{
+	const unsigned val = tail >> SPIN_TAIL_SHIFT;
+
+	return &spin_nodes[(val >> 2) - 1][val & 3];
+}
+
+/* Nodes are only used while waiting: the waiter at the head of the queue
+ * passes the headship to the next one as soon as it gets the lock, so the
+ * unlock is just clearing the locked byte and locks can be released in
+ * any order. */
+static void __spin_lock_slow(struct spinlock *lock)
+{
+	const int cpu = cpu_id();
+	const int idx = spin_nodes_used++;
+
+	/* an interrupt coming after this point takes the next node */
+	atomic_signal_fence(memory_order_seq_cst);
+	BUG_ON(idx >= SPIN_NODES);
+
+	struct spin_node *node = &spin_nodes[cpu][idx];
+	const unsigned tail = spin_encode_tail(cpu, idx);
+	unsigned val = atomic_load_explicit(&lock->val, memory_order_relaxed);
+
+	atomic_store_explicit(&node->next, 0, memory_order_relaxed);
+	atomic_store_explicit(&node->locked, 0, memory_order_relaxed);
+
+	while (!atomic_compare_exchange_weak_explicit(&lock->val, &val,
+				(val & ~SPIN_TAIL_MASK) | tail,
+				memory_order_acq_rel, memory_order_relaxed));
+
+	if (val & SPIN_TAIL_MASK) {
+		struct spin_node *prev = spin_decode_tail(val & SPIN_TAIL_MASK);
+
+		atomic_store_explicit(&prev->next, node, memory_order_release);
+		while (!atomic_load_explicit(&node->locked,
+					memory_order_acquire))
+			cpu_relax();
+	}
+
+	/* we are the head, nobody but the owner touches the locked byte */
+	while ((val = atomic_load_explicit(&lock->val, memory_order_acquire))
+				& SPIN_LOCKED_MASK)
+		cpu_relax();
+
+	while ((val & SPIN_TAIL_MASK) == tail) {
+		if (atomic_compare_exchange_weak_explicit(&lock->val, &val,
+					SPIN_LOCKED, memory_order_acquire,
+					memory_order_relaxed))
+			goto out;
+	}
+
+	atomic_fetch_or_explicit(&lock->val, SPIN_LOCKED,
+				memory_order_acquire);
+
+	struct spin_node *next;
+
+	while (!(next = atomic_load_explicit(&node->next,
+				memory_order_acquire)))
+		cpu_relax();
+	atomic_store_explicit(&next->locked, 1, memory_order_release);
+out:
+	atomic_signal_fence(memory_order_seq_cst);
+	--spin_nodes_used;
+}
+
+static int __spin_trylock(struct spinlock *lock)
+{
+	unsigned val = 0;
+
+	return atomic_compare_exchange_strong_explicit(&lock->val, &val,
+				SPIN_LOCKED, memory_order_acquire,
 				memory_order_relaxed);
 }
 
+static void __spin_unlock(struct spinlock *lock)
+{
+	atomic_fetch_sub_explicit(&lock->val, SPIN_LOCKED,
+				memory_order_release);
+}
+
+static void __spin_lock_init(struct spinlock *lock, const void *class)
+{
+	atomic_init(&lock->val, 0);
+	lockstat_init(lock, class);
+}
+
 void spin_lock_init(struct spinlock *lock)
 {
-	atomic_init(&lock->next, 0);
-	atomic_init(&lock->current, 0);
+	__spin_lock_init(lock, LOCK_SITE);
+}
+
+static void spin_lock_at(struct spinlock *lock, const void *site)
+{
+	const unsigned long long start = lockstat_start();
+	int contended = 0;
+
+	preempt_disable();
+	if (!__spin_trylock(lock)) {
+		__spin_lock_slow(lock);
+		contended = 1;
+	}
+	lockstat_acquired(lock, site, start, contended);
 }
 
 void spin_lock(struct spinlock *lock)
+{
+	spin_lock_at(lock, LOCK_SITE);
+}
+
+int spin_trylock(struct spinlock *lock)
 {
 	preempt_disable();
-	__spin_lock(lock);
+	if (__spin_trylock(lock)) {
+		lockstat_acquired(lock, LOCK_SITE, 0ull, 0);
+		return 1;
+	}
+	preempt_enable();
+	return 0;
 }
 
 unsigned long spin_lock_save(struct spinlock *lock)
 {
 	const unsigned long flags = local_int_save();
 
-	spin_lock(lock);
+	spin_lock_at(lock, LOCK_SITE);
 	return flags;
 }
 
 void spin_unlock(struct spinlock *lock)
 {
+	lockstat_release(lock);
 	__spin_unlock(lock);
 	preempt_enable();
 }
@@ -56,67 +359,98 @@ void spin_unlock_restore(struct spinlock *lock, unsigned long flags)
 	local_int_restore(flags);
 }
 
+#define RW_WRITER	(1u << 31)
+#define RW_WAITING	(1u << 30)
+#define RW_READERS	(RW_WAITING - 1)
+
 void rwlock_init(struct rwlock *lock)
 {
-	atomic_init(&lock->write, 0);
-	atomic_init(&lock->read, 0);
-	atomic_init(&lock->next, 0);
+	atomic_init(&lock->val, 0);
+	lockstat_init(lock, LOCK_SITE);
 }
 
-static void __read_lock(struct rwlock *lock)
+/* returns non zero if it had to wait for a writer */
+static int __read_lock(struct rwlock *lock)
 {
-	const unsigned ticket = atomic_fetch_add_explicit(&lock->next, 1,
-				memory_order_relaxed);
+	unsigned val = atomic_load_explicit(&lock->val, memory_order_relaxed);
+	int waited = 0;
 
-	while (atomic_load_explicit(&lock->read, memory_order_relaxed)
-				!= ticket)
-		cpu_relax();
-	atomic_store_explicit(&lock->read, ticket + 1, memory_order_relaxed);
-	atomic_thread_fence(memory_order_acquire);
+	while (1) {
+		if (val & (RW_WRITER | RW_WAITING)) {
+			waited = 1;
+			cpu_relax();
+			val = atomic_load_explicit(&lock->val,
+						memory_order_relaxed);
+			continue;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&lock->val, &val,
+					val + 1, memory_order_acquire,
+					memory_order_relaxed))
+			return waited;
+	}
 }
 
 static void __read_unlock(struct rwlock *lock)
 {
-	atomic_thread_fence(memory_order_release);
-	atomic_fetch_add_explicit(&lock->write, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&lock->val, 1, memory_order_release);
 }
 
-static void __write_lock(struct rwlock *lock)
+/* Waiting bit may be set by several writers, whoever gets the lock clears
+ * it and the others set it again. */
+static int __write_lock(struct rwlock *lock)
 {
-	const unsigned ticket = atomic_fetch_add_explicit(&lock->next, 1,
-				memory_order_relaxed);
+	unsigned val = atomic_load_explicit(&lock->val, memory_order_relaxed);
+	int waited = 0;
+
+	while (1) {
+		if (!(val & (RW_WRITER | RW_READERS))) {
+			if (atomic_compare_exchange_weak_explicit(&lock->val,
+						&val, RW_WRITER,
+						memory_order_acquire,
+						memory_order_relaxed))
+				return waited;
+			continue;
+		}
+
+		waited = 1;
+
+		if (!(val & RW_WAITING) &&
+			!atomic_compare_exchange_weak_explicit(&lock->val,
+						&val, val | RW_WAITING,
+						memory_order_relaxed,
+						memory_order_relaxed))
+			continue;
 
-	while (atomic_load_explicit(&lock->write, memory_order_relaxed)
-				!= ticket)
 		cpu_relax();
-	atomic_thread_fence(memory_order_acquire);
+		val = atomic_load_explicit(&lock->val, memory_order_relaxed);
+	}
 }
 
 static void __write_unlock(struct rwlock *lock)
 {
-	const unsigned read = atomic_load_explicit(&lock->read,
-				memory_order_relaxed);
-	const unsigned write = atomic_load_explicit(&lock->write,
-				memory_order_relaxed);
+	atomic_fetch_and_explicit(&lock->val, ~RW_WRITER,
+				memory_order_release);
+}
 
-	atomic_thread_fence(memory_order_release);
-	atomic_store_explicit(&lock->read, read + 1,
-				memory_order_relaxed);
-	atomic_store_explicit(&lock->write, write + 1,
-				memory_order_relaxed);
+static void read_lock_at(struct rwlock *lock, const void *site)
+{
+	const unsigned long long start = lockstat_start();
+
+	preempt_disable();
+	lockstat_read_acquired(lock, site, start, __read_lock(lock));
 }
 
 void read_lock(struct rwlock *lock)
 {
-	preempt_disable();
-	__read_lock(lock);
+	read_lock_at(lock, LOCK_SITE);
 }
 
 unsigned long read_lock_save(struct rwlock *lock)
 {
 	const unsigned long flags = local_int_save();
 
-	read_lock(lock);
+	read_lock_at(lock, LOCK_SITE);
 	return flags;
 }
 
@@ -132,22 +466,30 @@ void read_unlock_restore(struct rwlock *lock, unsigned long flags)
 	local_int_restore(flags);
 }
 
-void write_lock(struct rwlock *lock)
+static void write_lock_at(struct rwlock *lock, const void *site)
 {
+	const unsigned long long start = lockstat_start();
+
 	preempt_disable();
-	__write_lock(lock);
+	lockstat_acquired(lock, site, start, __write_lock(lock));
+}
+
+void write_lock(struct rwlock *lock)
+{
+	write_lock_at(lock, LOCK_SITE);
 }
 
 unsigned long write_lock_save(struct rwlock *lock)
 {
 	const unsigned long flags = local_int_save();
 
-	write_lock(lock);
+	write_lock_at(lock, LOCK_SITE);
 	return flags;
 }
 
 void write_unlock(struct rwlock *lock)
 {
+	lockstat_release(lock);
 	__write_unlock(lock);
 	preempt_enable();
 }
@@ -157,3 +499,146 @@ void write_unlock_restore(struct rwlock *lock, unsigned long flags)
 	write_unlock(lock);
 	local_int_restore(flags);
 }
+
+void brlock_readers_init(struct brlock_readers *readers)
+{
+	for (int i = 0; i != MAX_CPU_NR; ++i)
+		atomic_init(&readers->cpu[i].seq, 0);
+}
+
+void brlock_init(struct brlock *lock, struct brlock_readers *readers)
+{
+	__spin_lock_init(&lock->lock, LOCK_SITE);
+	atomic_init(&lock->writer, 0);
+	lock->readers = readers;
+}
+
+/* Reader sequence is odd while the reader is inside. Both sides first
+ * announce themselves and then check the other one, so either the reader
+ * sees the writer or the writer sees the reader. */
+unsigned long br_read_lock_save(struct brlock *lock)
+{
+	const unsigned long flags = local_int_save();
+	atomic_ulong *seq = &lock->readers->cpu[cpu_id()].seq;
+
+	BUG_ON(atomic_load_explicit(seq, memory_order_relaxed) & 1);
+	while (1) {
+		atomic_fetch_add_explicit(seq, 1, memory_order_seq_cst);
+		if (!atomic_load_explicit(&lock->writer, memory_order_seq_cst))
+			break;
+
+		atomic_fetch_add_explicit(seq, 1, memory_order_release);
+		while (atomic_load_explicit(&lock->writer,
+					memory_order_relaxed))
+			cpu_relax();
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	return flags;
+}
+
+void br_read_unlock_restore(struct brlock *lock, unsigned long flags)
+{
+	atomic_ulong *seq = &lock->readers->cpu[cpu_id()].seq;
+
+	atomic_fetch_add_explicit(seq, 1, memory_order_release);
+	local_int_restore(flags);
+}
+
+static void br_write_lock_at(struct brlock *lock, const void *site)
+{
+	spin_lock_at(&lock->lock, site);
+	atomic_store_explicit(&lock->writer, 1, memory_order_seq_cst);
+
+	for (int i = 0; i != cpu_count(); ++i) {
+		atomic_ulong *seq = &lock->readers->cpu[i].seq;
+		const unsigned long old = atomic_load_explicit(seq,
+					memory_order_seq_cst);
+
+		if (!(old & 1))
+			continue;
+
+		while (atomic_load_explicit(seq, memory_order_relaxed) == old)
+			cpu_relax();
+	}
+	atomic_thread_fence(memory_order_acquire);
+}
+
+void br_write_lock(struct brlock *lock)
+{
+	br_write_lock_at(lock, LOCK_SITE);
+}
+
+unsigned long br_write_lock_save(struct brlock *lock)
+{
+	const unsigned long flags = local_int_save();
+
+	br_write_lock_at(lock, LOCK_SITE);
+	return flags;
+}
+
+void br_write_unlock(struct brlock *lock)
+{
+	atomic_store_explicit(&lock->writer, 0, memory_order_release);
+	spin_unlock(&lock->lock);
+}
+
+void br_write_unlock_restore(struct brlock *lock, unsigned long flags)
+{
+	br_write_unlock(lock);
+	local_int_restore(flags);
+}
+
+void seqlock_init(struct seqlock *lock)
+{
+	atomic_init(&lock->seq, 0);
+	__spin_lock_init(&lock->lock, LOCK_SITE);
+}
+
+unsigned read_seqbegin(const struct seqlock *lock)
+{
+	unsigned seq;
+
+	while ((seq = atomic_load_explicit(&lock->seq,
+				memory_order_acquire)) & 1)
+		cpu_relax();
+	return seq;
+}
+
+int read_seqretry(const struct seqlock *lock, unsigned seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&lock->seq, memory_order_relaxed) != seq;
+}
+
+static void write_seqlock_at(struct seqlock *lock, const void *site)
+{
+	spin_lock_at(&lock->lock, site);
+	atomic_fetch_add_explicit(&lock->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+void write_seqlock(struct seqlock *lock)
+{
+	write_seqlock_at(lock, LOCK_SITE);
+}
+
+unsigned long write_seqlock_save(struct seqlock *lock)
+{
+	const unsigned long flags = local_int_save();
+
+	write_seqlock_at(lock, LOCK_SITE);
+	return flags;
+}
+
+void write_sequnlock(struct seqlock *lock)
+{
+	atomic_fetch_add_explicit(&lock->seq, 1, memory_order_release);
+	spin_unlock(&lock->lock);
+}
+
+void write_sequnlock_restore(struct seqlock *lock, unsigned long flags)
+{
+	write_sequnlock(lock);
+	local_int_restore(flags);
+}
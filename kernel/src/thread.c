@@ -6,8 +6,10 @@
 #include <debug.h>
 #include <alloc.h>
 #include <time.h>
+#include <bitops.h>
 #include <cpu.h>
 #include <fpu.h>
+#include <vmem.h>
 
 struct thread_switch_frame {
 	uint64_t r15;
@@ -23,6 +25,18 @@ struct thread_switch_frame {
 static struct mem_cache thread_cache;
 static __percpu struct thread *current;
 
+/* Destroyed threads with default size stacks are kept on the cpu that
+ * destroyed them together with their stacks, so short lived threads
+ * don't go to the page allocator at all. */
+#define THREAD_POOL_SIZE	16
+
+struct thread_pool {
+	struct thread *threads[THREAD_POOL_SIZE];
+	int count;
+};
+
+static __percpu struct thread_pool thread_pool;
+
 
 static struct thread *thread_alloc(void)
 {
@@ -34,12 +48,106 @@ static void thread_free(struct thread *thread)
 	mem_cache_free(&thread_cache, thread);
 }
 
+static struct thread *thread_pool_get(void)
+{
+	const unsigned long flags = local_int_save();
+	struct thread *thread = 0;
+
+	if (thread_pool.count)
+		thread = thread_pool.threads[--thread_pool.count];
+	local_int_restore(flags);
+
+	return thread;
+}
+
+static int thread_pool_put(struct thread *thread)
+{
+	const unsigned long flags = local_int_save();
+	int cached = 0;
+
+	if (thread_pool.count != THREAD_POOL_SIZE) {
+		thread_pool.threads[thread_pool.count++] = thread;
+		cached = 1;
+	}
+	local_int_restore(flags);
+
+	return cached;
+}
+
+/* Registers of a cpu keep the fpu state of the thread that used them
+ * last until another thread restores its own, so a thread that comes back
+ * to the same cpu doesn't have to restore anything. State of a thread
+ * that used fpu is saved on every switch out, so the copy in memory is
+ * up to date for all threads that are not running. */
+static struct thread *thread_fpu_owner[MAX_CPU_NR];
+static __percpu int thread_fpu_loaded;
+
+static void thread_fpu_load(struct thread *thread)
+{
+	const int cpu = cpu_id();
+
+	fpu_enable();
+	if (thread->fpu_cpu != cpu || thread_fpu_owner[cpu] != thread) {
+		fpu_state_restore(thread->fpu_state);
+		thread_fpu_owner[cpu] = thread;
+		thread->fpu_cpu = cpu;
+	}
+	thread_fpu_loaded = 1;
+}
+
+/* Thread gets its fpu state the first time it uses fpu, until then every
+ * fpu instruction traps. In lazy mode the state is also loaded only when
+ * the thread uses fpu. */
+static void thread_fpu_trap(struct frame *frame)
+{
+	struct thread *thread = thread_current();
+
+	(void) frame;
+	BUG_ON(thread_fpu_loaded);
+	if (!thread->fpu_state)
+		BUG_ON(!(thread->fpu_state = fpu_state_alloc()));
+	thread_fpu_load(thread);
+}
+
+static void thread_fpu_restore(struct thread *thread)
+{
+	thread_fpu_loaded = 0;
+	if (!thread->fpu_state || fpu_get_mode() == FPU_MODE_LAZY) {
+		fpu_disable();
+		return;
+	}
+	thread_fpu_load(thread);
+}
+
+static void thread_fpu_save(struct thread *thread)
+{
+	if (thread_fpu_loaded)
+		fpu_state_save(thread->fpu_state);
+}
+
+static void thread_sched_setup(struct thread *thread)
+{
+	thread->vruntime = 0;
+	thread->exec_start = rdtsc();
+	thread->runtime = 0;
+	wait_queue_init(&thread->join_wait);
+	thread->nice = 0;
+	thread->weight = scheduler_nice_weight(0);
+	thread->policy = THREAD_FAIR;
+	thread->rt_priority = 0;
+	thread->affinity = ~0ul;
+	thread->cpu = -1;
+	thread->migrate_cpu = -1;
+	atomic_store_explicit(&thread->on_cpu, 0, memory_order_relaxed);
+}
+
 void threads_setup(void)
 {
 	const size_t size = sizeof(struct thread);
 	const size_t align = 64;
 
 	mem_cache_setup(&thread_cache, size, align);
+	register_exception_handler(FPU_NM_EXCEPTION, &thread_fpu_trap);
 }
 
 void threads_cpu_setup(void)
@@ -53,12 +161,16 @@ void threads_cpu_setup(void)
 	 * addr and size, we need single source of truth. */
 	__asm__ volatile ("movq %%rsp, %0" : "=rm"(rsp));
 	thread->stack_addr = rsp & ~((uint64_t)PAGE_SIZE - 1);
-	thread->stack_order = 0;
+	thread->stack_size = PAGE_SIZE;
 	thread->timestamp = current_time();
+	thread_sched_setup(thread);
 	thread_set_state(thread, THREAD_ACTIVE);
+	atomic_store_explicit(&thread->on_cpu, 1, memory_order_relaxed);
 
-	BUG_ON(!(thread->fpu_state = mem_alloc(fpu_state_size())));
-	fpu_state_setup(thread->fpu_state);
+	thread->fpu_state = 0;
+	thread->fpu_cpu = -1;
+	thread_fpu_loaded = 0;
+	fpu_disable();
 
 	current = thread;
 }
@@ -68,8 +180,23 @@ static void place_thread(struct thread *next)
 	struct thread *prev = thread_current();
 
 	current = next;
-	if (thread_get_state(prev) == THREAD_FINISHING)
+	atomic_store_explicit(&next->on_cpu, 1, memory_order_relaxed);
+	thread_fpu_restore(next);
+
+	/* once switch_finish puts prev back to a queue another cpu may pick
+	 * it up and mark it running */
+	if (prev != next)
+		atomic_store_explicit(&prev->on_cpu, 0, memory_order_relaxed);
+	scheduler_switch_finish(prev);
+
+	/* joiners free the thread once it's finished, so it's set under
+	 * the queue lock they take before they return */
+	if (thread_get_state(prev) == THREAD_FINISHING) {
+		spin_lock(&prev->join_wait.lock);
 		thread_set_state(prev, THREAD_FINISHED);
+		__wait_wake_all(&prev->join_wait);
+		spin_unlock(&prev->join_wait.lock);
+	}
 }
 
 void thread_entry(struct thread *thread, thread_fptr_t fptr, void *arg)
@@ -83,37 +210,51 @@ void thread_entry(struct thread *thread, thread_fptr_t fptr, void *arg)
 		schedule();
 }
 
-struct thread *__thread_create(thread_fptr_t fptr, void *arg, int stack_order)
+/* Stacks are virtually contiguous, so big stacks don't need physically
+ * contiguous memory. */
+static struct thread *thread_stack_alloc(size_t stack_size, void *site)
 {
-	void __thread_entry(void);
+	const size_t stack_pages = (stack_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	struct thread *thread;
 
-	const uintptr_t stack_addr = page_alloc(stack_order, PA_ANY);
-	const size_t stack_size = (size_t)1 << (PAGE_SHIFT + stack_order);
+	if (stack_pages == 1 && (thread = thread_pool_get()))
+		return thread;
 
-	if (!stack_addr)
-		return 0;
+	void *stack = vmem_alloc(stack_pages << PAGE_SHIFT);
 
-	struct thread *thread = thread_alloc();
+	if (!stack)
+		return 0;
 
-	if (!thread) {
-		page_free(stack_addr, stack_order);
+	mem_frag_account(site, stack_size, stack_pages << PAGE_SHIFT);
+	if (!(thread = thread_alloc())) {
+		vmem_free(stack);
 		return 0;
 	}
 
-	thread->fpu_state = mem_alloc(fpu_state_size());
-	if (!thread->fpu_state) {
-		page_free(stack_addr, stack_order);
-		thread_free(thread);
+	thread->stack_addr = (uintptr_t)stack;
+	thread->stack_size = stack_pages << PAGE_SHIFT;
+	return thread;
+}
+
+struct thread *__thread_create(thread_fptr_t fptr, void *arg,
+			size_t stack_size)
+{
+	void __thread_entry(void);
+
+	struct thread *thread = thread_stack_alloc(stack_size,
+				__builtin_return_address(0));
+
+	if (!thread)
 		return 0;
-	}
-	fpu_state_setup(thread->fpu_state);
 
 	struct thread_switch_frame *frame;
 
-	thread->stack_addr = stack_addr;
-	thread->stack_order = stack_order;
-	thread->stack_ptr = stack_addr + stack_size - sizeof(*frame);
-	thread_set_state(thread, THREAD_BLOCKED);
+	thread->fpu_state = 0;
+	thread->fpu_cpu = -1;
+	thread->stack_ptr = thread->stack_addr + thread->stack_size
+				- sizeof(*frame);
+	thread_sched_setup(thread);
+	thread_set_state(thread, THREAD_SLEEPING);
 
 	frame = (struct thread_switch_frame *)thread->stack_ptr;
 	frame->r12 = (uintptr_t)thread;
@@ -128,24 +269,47 @@ struct thread *__thread_create(thread_fptr_t fptr, void *arg, int stack_order)
 
 struct thread *thread_create(thread_fptr_t fptr, void *arg)
 {
-	const int default_stack_order = 0;
+	const size_t default_stack_size = PAGE_SIZE;
 
-	return __thread_create(fptr, arg, default_stack_order);
+	return __thread_create(fptr, arg, default_stack_size);
 }
 
 void thread_join(struct thread *thread)
 {
-	while (thread_get_state(thread) != THREAD_FINISHED)
+	struct wait_entry wait;
+
+	wait_entry_init(&wait);
+	while (1) {
+		wait_prepare(&thread->join_wait, &wait);
+		if (thread_get_state(thread) == THREAD_FINISHED)
+			break;
 		schedule();
+	}
+	wait_finish(&thread->join_wait, &wait);
 }
 
 void thread_destroy(struct thread *thread)
 {
-	mem_free(thread->fpu_state);
-	page_free(thread->stack_addr, thread->stack_order);
+	if (thread->fpu_state)
+		fpu_state_free(thread->fpu_state);
+
+	if (thread->stack_size == PAGE_SIZE && thread_pool_put(thread))
+		return;
+
+	vmem_free((void *)thread->stack_addr);
 	thread_free(thread);
 }
 
+/* Stacks of created threads come from vmem, so the page right below the
+ * stack is never mapped and a fault there means the stack overflowed. */
+int thread_stack_overflow(const struct thread *thread, uintptr_t addr)
+{
+	if (!vmem_addr((const void *)thread->stack_addr))
+		return 0;
+	return addr < thread->stack_addr &&
+				addr >= thread->stack_addr - VMEM_GUARD;
+}
+
 struct thread *thread_current(void)
 {
 	return current;
@@ -157,6 +321,112 @@ void thread_activate(struct thread *thread)
 	scheduler_activate_thread(thread);
 }
 
+/* Weight only affects runtime accounted from now on, so there is no need
+ * to requeue the thread. */
+void thread_set_nice(struct thread *thread, int nice)
+{
+	BUG_ON(nice < SCHEDULER_NICE_MIN || nice > SCHEDULER_NICE_MAX);
+	thread->weight = scheduler_nice_weight(nice);
+	thread->nice = nice;
+}
+
+int thread_get_nice(struct thread *thread)
+{
+	return thread->nice;
+}
+
+/* Thread must not be queued, i.e. it's either the current thread or it
+ * hasn't been activated yet. */
+void thread_set_policy(struct thread *thread, int policy, int priority)
+{
+	BUG_ON(policy != THREAD_FAIR && policy != THREAD_FIFO &&
+				policy != THREAD_RR);
+	BUG_ON(priority < 0 || priority >= THREAD_RT_PRIOS);
+	thread->policy = policy;
+	thread->rt_priority = priority;
+}
+
+/* New affinity is honored the next time the thread is queued, and the
+ * current thread moves to an allowed cpu right away. */
+void thread_set_affinity(struct thread *thread, unsigned long affinity)
+{
+	BUG_ON(!(affinity & ((1ul << cpu_count()) - 1)));
+	thread->affinity = affinity;
+
+	if (thread != thread_current())
+		return;
+
+	const unsigned long flags = local_int_save();
+	const int cpu = cpu_id();
+
+	local_int_restore(flags);
+	if (!((affinity >> cpu) & 1))
+		thread_migrate(bsf(affinity));
+}
+
+unsigned long thread_get_affinity(struct thread *thread)
+{
+	return thread->affinity;
+}
+
+/* Moves the current thread to the cpu. Unless the affinity pins it there,
+ * the thread may be moved again later by load balancing. */
+void thread_migrate(int cpu)
+{
+	struct thread *self = thread_current();
+
+	BUG_ON(cpu < 0 || cpu >= cpu_count());
+	BUG_ON(!((self->affinity >> cpu) & 1));
+	scheduler_migrate(cpu);
+}
+
+int thread_cpu(struct thread *thread)
+{
+	return thread->cpu;
+}
+
+int thread_on_cpu(struct thread *thread)
+{
+	return atomic_load_explicit(&thread->on_cpu, memory_order_relaxed);
+}
+
+/* Cpu time of the thread in tsc cycles, the running slice is included
+ * only for the current thread. */
+unsigned long long thread_cpu_time(struct thread *thread)
+{
+	const unsigned long flags = local_int_save();
+	unsigned long long runtime = thread->runtime;
+
+	if (thread == thread_current())
+		runtime += rdtsc() - thread->exec_start;
+	local_int_restore(flags);
+
+	return runtime;
+}
+
+/* Thread that is still on its cpu queues itself when it switches out, see
+ * scheduler_switch_finish, a sleeping one is queued here. Returns 1 if
+ * the thread was blocked. */
+int thread_wake(struct thread *thread)
+{
+	int state = THREAD_BLOCKED;
+
+	if (atomic_compare_exchange_strong_explicit(&thread->state, &state,
+				THREAD_ACTIVE, memory_order_acq_rel,
+				memory_order_acquire))
+		return 1;
+
+	/* somebody else may wake it up meanwhile */
+	if (state != THREAD_SLEEPING ||
+			!atomic_compare_exchange_strong_explicit(&thread->state,
+				&state, THREAD_ACTIVE, memory_order_acq_rel,
+				memory_order_acquire))
+		return 0;
+
+	scheduler_activate_thread(thread);
+	return 1;
+}
+
 void thread_set_state(struct thread *thread, int state)
 {
 	atomic_store_explicit(&thread->state, state, memory_order_relaxed);
@@ -174,9 +444,8 @@ void thread_switch_to(struct thread *next)
 	const unsigned long flags = local_int_save();
 	struct thread *prev = thread_current();
 
-	fpu_state_save(prev->fpu_state);
+	thread_fpu_save(prev);
 	__thread_switch(&prev->stack_ptr, next->stack_ptr);
-	fpu_state_restore(prev->fpu_state);
 	place_thread(prev);
 
 	local_int_restore(flags);
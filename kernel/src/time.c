@@ -1,5 +1,9 @@
 #include <scheduler.h>
+#include <spinlock.h>
 #include <stdint.h>
+#include <percpu.h>
+#include <thread.h>
+#include <wait.h>
 #include <limits.h>
 #include <alloc.h>
 #include <debug.h>
@@ -8,6 +12,7 @@
 #include <apic.h>
 #include <ints.h>
 #include <cpu.h>
+#include <vmem.h>
 #include <rcu.h>
 
 
@@ -45,6 +50,24 @@ static struct hpet_block *default_block;
 static int default_timer, default_timer_level;
 static unsigned long long ticks_elapsed;
 static unsigned long apic_ticks;
+static unsigned long long tsc_ticks;
+static int tsc_deadline;
+
+#define IA32_TSC_DEADLINE	0x6e0
+
+/* tick isn't periodic by default: the local timer is programmed for the
+ * next event only, see time_cpu_rearm */
+static int time_tickless = 1;
+static __percpu unsigned long apic_timer_mode;
+static __percpu int apic_timer_started;
+static unsigned long apic_timer_irqs[MAX_CPU_NR];
+
+struct timer_base {
+	struct spinlock lock;
+	struct list_head timers;
+};
+
+static struct timer_base timer_base[MAX_CPU_NR];
 
 
 unsigned long long current_time(void)
@@ -339,18 +362,252 @@ static void apic_timer_calibrate(void)
 	local_apic_write(APIC_TIMER_LVT, lvt);
 	local_apic_write(APIC_TIMER_INIT, 0xfffffffful);
 
+	const unsigned long long tsc = rdtsc();
+
 	udelay(TIMER_TICK * 1000);
 
 	const unsigned long count = local_apic_read(APIC_TIMER_COUNT);
 
+	tsc_ticks = rdtsc() - tsc;
 	local_apic_write(APIC_TIMER_INIT, 0);
 	apic_ticks = 0xfffffffful - count;
 }
 
+void timer_setup(struct timer *timer, void (*fptr)(struct timer *))
+{
+	list_init(&timer->ll);
+	timer->fptr = fptr;
+	timer->cpu = -1;
+}
+
+void timer_add(struct timer *timer, unsigned long long expires)
+{
+	const unsigned long flags = local_int_save();
+	const int cpu = cpu_id();
+	struct timer_base *base = &timer_base[cpu];
+	struct list_head *head = &base->timers;
+	struct list_head *ptr = head->next;
+
+	BUG_ON(timer->cpu != -1);
+	timer->expires = expires;
+	timer->cpu = cpu;
+
+	spin_lock(&base->lock);
+	for (; ptr != head; ptr = ptr->next) {
+		const struct timer *next = LIST_ENTRY(ptr, struct timer, ll);
+
+		if (next->expires > expires)
+			break;
+	}
+	list_insert_before(&timer->ll, ptr);
+	spin_unlock(&base->lock);
+
+	if (head->next == &timer->ll)
+		time_cpu_rearm();
+	local_int_restore(flags);
+}
+
+/* Returns 1 if the timer was pending. A timer that is already running
+ * isn't waited for. */
+int timer_del(struct timer *timer)
+{
+	const int cpu = timer->cpu;
+
+	if (cpu == -1)
+		return 0;
+
+	struct timer_base *base = &timer_base[cpu];
+	const unsigned long flags = spin_lock_save(&base->lock);
+	const int pending = timer->cpu == cpu;
+
+	if (pending) {
+		list_del(&timer->ll);
+		timer->cpu = -1;
+	}
+	spin_unlock_restore(&base->lock, flags);
+
+	return pending;
+}
+
+struct time_sleeper {
+	struct timer timer;
+	struct wait_queue wait;
+	int expired;
+};
+
+static void time_sleeper_wake(struct timer *timer)
+{
+	struct time_sleeper *sleeper = CONTAINER_OF(timer,
+				struct time_sleeper, timer);
+	const unsigned long flags = spin_lock_save(&sleeper->wait.lock);
+
+	sleeper->expired = 1;
+	__wait_wake(&sleeper->wait);
+	spin_unlock_restore(&sleeper->wait.lock, flags);
+}
+
+/* Blocks the current thread for the given number of ticks. */
+void time_sleep(unsigned long long ticks)
+{
+	struct time_sleeper sleeper;
+	struct wait_entry wait;
+
+	sleeper.expired = 0;
+	wait_queue_init(&sleeper.wait);
+	wait_entry_init(&wait);
+	timer_setup(&sleeper.timer, &time_sleeper_wake);
+	timer_add(&sleeper.timer, current_time() + ticks);
+
+	unsigned long flags = spin_lock_save(&sleeper.wait.lock);
+
+	while (!sleeper.expired) {
+		__wait_prepare(&sleeper.wait, &wait);
+		spin_unlock_restore(&sleeper.wait.lock, flags);
+		schedule();
+		flags = spin_lock_save(&sleeper.wait.lock);
+	}
+	__wait_finish(&sleeper.wait, &wait);
+	spin_unlock_restore(&sleeper.wait.lock, flags);
+}
+
+static void timer_run(void)
+{
+	struct timer_base *base = &timer_base[cpu_id()];
+	struct list_head *head = &base->timers;
+	const unsigned long long now = current_time();
+
+	spin_lock(&base->lock);
+	while (!list_empty(head)) {
+		struct timer *timer = LIST_ENTRY(head->next, struct timer, ll);
+
+		if (timer->expires > now)
+			break;
+
+		list_del(&timer->ll);
+		timer->cpu = -1;
+		spin_unlock(&base->lock);
+		timer->fptr(timer);
+		spin_lock(&base->lock);
+	}
+	spin_unlock(&base->lock);
+}
+
+static unsigned long long timer_next(void)
+{
+	struct timer_base *base = &timer_base[cpu_id()];
+	unsigned long long expires = 0;
+
+	spin_lock(&base->lock);
+	if (!list_empty(&base->timers)) {
+		const struct timer *timer = LIST_ENTRY(base->timers.next,
+					struct timer, ll);
+
+		expires = timer->expires;
+	}
+	spin_unlock(&base->lock);
+
+	return expires;
+}
+
+static void apic_timer_stop(void)
+{
+	if (apic_timer_mode == APIC_TIMER_TSC_DEADLINE)
+		write_msr(IA32_TSC_DEADLINE, 0);
+	else
+		local_apic_write(APIC_TIMER_INIT, 0);
+}
+
+static void apic_timer_set_mode(unsigned long mode)
+{
+	if (apic_timer_mode == mode)
+		return;
+
+	apic_timer_stop();
+	apic_timer_mode = mode;
+	local_apic_write(APIC_TIMER_LVT, IRQ_VECTOR(TIMER_LOCAL_IRQ) | mode);
+
+	if (mode == APIC_TIMER_PERIODIC)
+		local_apic_write(APIC_TIMER_INIT, apic_ticks);
+	else if (mode == APIC_TIMER_TSC_DEADLINE)
+		/* lvt write must be ordered before the deadline msr write */
+		__asm__ volatile ("mfence" : : : "memory");
+}
+
+static void apic_timer_arm(unsigned long long delta)
+{
+	if (apic_timer_mode == APIC_TIMER_TSC_DEADLINE) {
+		write_msr(IA32_TSC_DEADLINE, rdtsc() + delta * tsc_ticks);
+		return;
+	}
+
+	const unsigned long long max = 0xfffffffful / apic_ticks;
+
+	if (delta > max)
+		delta = max;
+	local_apic_write(APIC_TIMER_INIT, delta * apic_ticks);
+}
+
+/* Programs the next local timer interrupt for the earliest of the slice
+ * end of the current thread and the first pending timer. A cpu that has
+ * neither and no RCU callbacks to push along gets no interrupts at all. */
+void time_cpu_rearm(void)
+{
+	if (!apic_timer_started)
+		return;
+
+	const unsigned long flags = local_int_save();
+
+	if (!time_tickless) {
+		apic_timer_set_mode(APIC_TIMER_PERIODIC);
+		local_int_restore(flags);
+		return;
+	}
+
+	apic_timer_set_mode(tsc_deadline ? APIC_TIMER_TSC_DEADLINE
+				: APIC_TIMER_ONE_SHOT);
+
+	const unsigned long long now = current_time();
+	const unsigned long long expires = timer_next();
+	unsigned long long deadline = scheduler_slice_end();
+
+	if (expires && (!deadline || expires < deadline))
+		deadline = expires;
+
+	if (rcu_pending() && (!deadline || deadline > now + 1))
+		deadline = now + 1;
+
+	if (deadline)
+		apic_timer_arm(deadline > now ? deadline - now : 1);
+	else
+		apic_timer_stop();
+	local_int_restore(flags);
+}
+
+void time_set_tickless(int tickless)
+{
+	time_tickless = tickless;
+	time_cpu_rearm();
+	scheduler_wake_all();
+}
+
+unsigned long long time_tick_cycles(void)
+{
+	return tsc_ticks;
+}
+
+unsigned long time_cpu_ticks(int cpu)
+{
+	return apic_timer_irqs[cpu];
+}
+
 static void apic_timer_handler(void)
 {
-	schedule();
+	++apic_timer_irqs[cpu_id()];
+	timer_run();
 	rcu_tick();
+	vmem_cpu_tick();
+	schedule();
+	time_cpu_rearm();
 }
 
 static void apic_timer_ints_setup(void)
@@ -364,26 +621,32 @@ static void apic_timer_ints_setup(void)
 
 static void apic_timer_setup(void)
 {
-	apic_timer_calibrate();
-	apic_timer_ints_setup();
-}
+	unsigned long eax = 1, ebx, ecx, edx;
 
-static void apic_timer_start(void)
-{
-	const unsigned long lvt = IRQ_VECTOR(TIMER_LOCAL_IRQ)
-				| APIC_TIMER_PERIODIC;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	tsc_deadline = (ecx & (1ul << 24)) != 0;
+	printf("local timer uses %s\n", tsc_deadline ? "tsc deadline"
+				: "apic one shot");
 
-	local_apic_write(APIC_TIMER_LVT, lvt);
-	local_apic_write(APIC_TIMER_INIT, apic_ticks);
+	apic_timer_calibrate();
+	apic_timer_ints_setup();
 }
 
 void time_setup(void)
 {
+	for (int i = 0; i != MAX_CPU_NR; ++i) {
+		spin_lock_init(&timer_base[i].lock);
+		list_init(&timer_base[i].timers);
+	}
+
 	hpet_setup();
 	apic_timer_setup();
 }
 
 void time_cpu_setup(void)
 {
-	apic_timer_start();
+	/* no mode yet, so the first rearm programs lvt */
+	apic_timer_mode = ~0ul;
+	apic_timer_started = 1;
+	time_cpu_rearm();
 }
@@ -0,0 +1,286 @@
+#include <stdatomic.h>
+#include <spinlock.h>
+#include <memory.h>
+#include <paging.h>
+#include <rbtree.h>
+#include <alloc.h>
+#include <debug.h>
+#include <vmem.h>
+#include <cpu.h>
+
+
+/* Area is followed by an unmapped guard page and the first area is
+ * preceded by one, so there is a guard page on both sides of each.
+ * Freed areas keep their virtual range until every cpu flushed TLB after
+ * the unmap, gen is the value of vmem_gen the cpus have to reach. */
+struct vmem_area {
+	struct rb_node rb;
+	struct list_head ll;
+	struct list_head pages;
+	uintptr_t begin;
+	uintptr_t end;
+	unsigned long gen;
+};
+
+static struct mem_cache vmem_area_cache;
+static struct spinlock vmem_lock;
+static struct rb_tree vmem_areas;
+static struct list_head vmem_lazy;
+static atomic_ulong vmem_gen;
+static atomic_ulong vmem_cpu_gen[MAX_CPU_NR];
+static int vmem_enabled;
+
+
+static struct vmem_area *vmem_find_area(uintptr_t addr)
+{
+	struct rb_node *node = vmem_areas.root;
+
+	while (node) {
+		struct vmem_area *area = TREE_ENTRY(node, struct vmem_area, rb);
+
+		if (area->begin == addr)
+			return area;
+
+		if (area->begin > addr)
+			node = node->left;
+		else
+			node = node->right;
+	}
+
+	return 0;
+}
+
+static void vmem_insert_area(struct vmem_area *new)
+{
+	struct rb_node **plink = &vmem_areas.root;
+	struct rb_node *parent = 0;
+
+	while (*plink) {
+		struct vmem_area *old = TREE_ENTRY(*plink, struct vmem_area,
+					rb);
+
+		parent = *plink;
+		if (old->begin > new->begin)
+			plink = &parent->left;
+		else
+			plink = &parent->right;
+	}
+
+	rb_link(&new->rb, parent, plink);
+	rb_insert(&new->rb, &vmem_areas);
+}
+
+static uintptr_t vmem_find_gap(size_t size)
+{
+	uintptr_t addr = VMEM_BEGIN + VMEM_GUARD;
+
+	for (struct rb_node *node = rb_leftmost(&vmem_areas); node;
+				node = rb_next(node)) {
+		const struct vmem_area *area = TREE_ENTRY(node,
+					struct vmem_area, rb);
+
+		if (area->begin - addr >= size)
+			break;
+		addr = area->end + VMEM_GUARD;
+	}
+
+	if (VMEM_END - addr < size)
+		return 0;
+	return addr;
+}
+
+static unsigned long vmem_flushed_gen(void)
+{
+	unsigned long gen = atomic_load_explicit(&vmem_gen,
+				memory_order_acquire);
+
+	for (int i = 0; i != cpu_count(); ++i) {
+		const unsigned long cpu_gen = atomic_load_explicit(
+					&vmem_cpu_gen[i], memory_order_acquire);
+
+		if (cpu_gen < gen)
+			gen = cpu_gen;
+	}
+	return gen;
+}
+
+static int vmem_purge(void)
+{
+	const unsigned long gen = vmem_flushed_gen();
+	struct list_head *head = &vmem_lazy;
+	int purged = 0;
+
+	for (struct list_head *ptr = head->next; ptr != head;) {
+		struct vmem_area *area = LIST_ENTRY(ptr, struct vmem_area, ll);
+
+		ptr = ptr->next;
+		if (area->gen > gen)
+			continue;
+
+		list_del(&area->ll);
+		rb_erase(&area->rb, &vmem_areas);
+		mem_cache_free(&vmem_area_cache, area);
+		++purged;
+	}
+
+	return purged;
+}
+
+static void vmem_free_pages(struct list_head *pages)
+{
+	struct list_head *head = pages;
+
+	for (struct list_head *ptr = head->next; ptr != head;) {
+		struct page *page = LIST_ENTRY(ptr, struct page, ll);
+
+		ptr = ptr->next;
+		__page_free(page, 0);
+	}
+	list_init(pages);
+}
+
+static int vmem_alloc_pages(struct list_head *pages, size_t count)
+{
+	for (size_t i = 0; i != count; ++i) {
+		struct page *page = __page_alloc(0, PA_ANY);
+
+		if (!page) {
+			vmem_free_pages(pages);
+			return -1;
+		}
+		list_add_tail(&page->ll, pages);
+	}
+
+	return 0;
+}
+
+/* Physically contiguous runs of pages are mapped with a single pt_map
+ * call, so they can use large pages and need only one pt_range. */
+static int vmem_map_pages(struct vmem_area *area)
+{
+	struct list_head *head = &area->pages;
+	struct list_head *ptr = head->next;
+	uintptr_t virt = area->begin;
+
+	while (ptr != head) {
+		const uintptr_t phys = page_addr(LIST_ENTRY(ptr,
+					struct page, ll));
+		size_t size = PAGE_SIZE;
+
+		for (ptr = ptr->next; ptr != head; ptr = ptr->next) {
+			struct page *page = LIST_ENTRY(ptr, struct page, ll);
+
+			if (page_addr(page) != phys + size)
+				break;
+			size += PAGE_SIZE;
+		}
+
+		if (pt_map(&kernel_pt, virt, virt + size, phys, PTE_WRITE)) {
+			if (virt != area->begin)
+				pt_unmap(&kernel_pt, area->begin, virt);
+			return -1;
+		}
+		virt += size;
+	}
+
+	return 0;
+}
+
+void *vmem_alloc(size_t size)
+{
+	if (!vmem_enabled || !size)
+		return 0;
+
+	const size_t pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	const size_t len = pages << PAGE_SHIFT;
+	struct vmem_area *area = mem_cache_alloc(&vmem_area_cache, PA_ANY);
+
+	if (!area)
+		return 0;
+
+	list_init(&area->pages);
+	if (vmem_alloc_pages(&area->pages, pages)) {
+		mem_cache_free(&vmem_area_cache, area);
+		return 0;
+	}
+
+	const unsigned long flags = spin_lock_save(&vmem_lock);
+	uintptr_t addr = vmem_find_gap(len + VMEM_GUARD);
+
+	if (!addr && vmem_purge())
+		addr = vmem_find_gap(len + VMEM_GUARD);
+
+	area->begin = addr;
+	area->end = addr + len;
+
+	if (!addr || vmem_map_pages(area)) {
+		spin_unlock_restore(&vmem_lock, flags);
+		vmem_free_pages(&area->pages);
+		mem_cache_free(&vmem_area_cache, area);
+		return 0;
+	}
+
+	vmem_insert_area(area);
+	spin_unlock_restore(&vmem_lock, flags);
+
+	return (void *)addr;
+}
+
+void vmem_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	const unsigned long flags = spin_lock_save(&vmem_lock);
+	struct vmem_area *area = vmem_find_area((uintptr_t)ptr);
+
+	BUG_ON(!area || area->gen);
+
+	pt_unmap(&kernel_pt, area->begin, area->end);
+	write_cr3(read_cr3());
+
+	area->gen = atomic_fetch_add_explicit(&vmem_gen, 1,
+				memory_order_release) + 1;
+	list_add_tail(&area->ll, &vmem_lazy);
+	spin_unlock_restore(&vmem_lock, flags);
+
+	vmem_free_pages(&area->pages);
+}
+
+size_t vmem_size(const void *ptr)
+{
+	const unsigned long flags = spin_lock_save(&vmem_lock);
+	const struct vmem_area *area = vmem_find_area((uintptr_t)ptr);
+
+	BUG_ON(!area || area->gen);
+
+	const size_t size = area->end - area->begin;
+
+	spin_unlock_restore(&vmem_lock, flags);
+	return size;
+}
+
+void vmem_cpu_tick(void)
+{
+	atomic_ulong *cpu_gen = &vmem_cpu_gen[cpu_id()];
+	const unsigned long gen = atomic_load_explicit(&vmem_gen,
+				memory_order_acquire);
+
+	if (atomic_load_explicit(cpu_gen, memory_order_relaxed) == gen)
+		return;
+
+	write_cr3(read_cr3());
+	atomic_store_explicit(cpu_gen, gen, memory_order_release);
+}
+
+void vmem_setup(void)
+{
+	BUG_ON(phys_mem_limit() > VMEM_BEGIN);
+
+	mem_cache_setup(&vmem_area_cache, sizeof(struct vmem_area),
+				sizeof(void *));
+	spin_lock_init(&vmem_lock);
+	list_init(&vmem_lazy);
+	vmem_areas.root = 0;
+	vmem_enabled = 1;
+}
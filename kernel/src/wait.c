@@ -0,0 +1,94 @@
+#include <scheduler.h>
+#include <thread.h>
+#include <wait.h>
+
+
+void wait_queue_init(struct wait_queue *queue)
+{
+	spin_lock_init(&queue->lock);
+	list_init(&queue->waiters);
+}
+
+void wait_entry_init(struct wait_entry *wait)
+{
+	list_init(&wait->ll);
+	wait->thread = thread_current();
+}
+
+/* Woken up entry is removed from the queue, so it's added again if the
+ * waiter has to wait more. */
+void __wait_prepare(struct wait_queue *queue, struct wait_entry *wait)
+{
+	if (list_empty(&wait->ll))
+		list_add_tail(&wait->ll, &queue->waiters);
+	thread_set_state(wait->thread, THREAD_BLOCKED);
+}
+
+void wait_prepare(struct wait_queue *queue, struct wait_entry *wait)
+{
+	const unsigned long flags = spin_lock_save(&queue->lock);
+
+	__wait_prepare(queue, wait);
+	spin_unlock_restore(&queue->lock, flags);
+}
+
+void __wait_finish(struct wait_queue *queue, struct wait_entry *wait)
+{
+	(void) queue;
+
+	thread_set_state(wait->thread, THREAD_ACTIVE);
+	if (!list_empty(&wait->ll)) {
+		list_del(&wait->ll);
+		list_init(&wait->ll);
+	}
+}
+
+void wait_finish(struct wait_queue *queue, struct wait_entry *wait)
+{
+	const unsigned long flags = spin_lock_save(&queue->lock);
+
+	__wait_finish(queue, wait);
+	spin_unlock_restore(&queue->lock, flags);
+}
+
+struct thread *__wait_wake(struct wait_queue *queue)
+{
+	if (list_empty(&queue->waiters))
+		return 0;
+
+	struct wait_entry *wait = LIST_ENTRY(list_first(&queue->waiters),
+				struct wait_entry, ll);
+	struct thread *thread = wait->thread;
+
+	list_del(&wait->ll);
+	list_init(&wait->ll);
+	thread_wake(thread);
+	return thread;
+}
+
+struct thread *wait_wake(struct wait_queue *queue)
+{
+	const unsigned long flags = spin_lock_save(&queue->lock);
+	struct thread *thread = __wait_wake(queue);
+
+	spin_unlock_restore(&queue->lock, flags);
+	return thread;
+}
+
+int __wait_wake_all(struct wait_queue *queue)
+{
+	int woken = 0;
+
+	while (__wait_wake(queue))
+		++woken;
+	return woken;
+}
+
+int wait_wake_all(struct wait_queue *queue)
+{
+	const unsigned long flags = spin_lock_save(&queue->lock);
+	const int woken = __wait_wake_all(queue);
+
+	spin_unlock_restore(&queue->lock, flags);
+	return woken;
+}